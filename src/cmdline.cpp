@@ -172,7 +172,10 @@ Cmdline::insert(const gchar *src)
 	while (pc < len) {
 		try {
 			Execute::step(str, pc+1);
+			ViewCurrent::end_snapshot();
 		} catch (Cmdline *new_cmdline) {
+			ViewCurrent::end_snapshot();
+
 			/*
 			 * Result of command line replacement (}):
 			 * Exchange command lines, avoiding
@@ -188,6 +191,8 @@ Cmdline::insert(const gchar *src)
 			delete new_cmdline;
 			continue;
 		} catch (Error &error) {
+			ViewCurrent::end_snapshot();
+
 			error.add_frame(new Error::ToplevelFrame());
 			error.display_short();
 
@@ -212,6 +217,9 @@ Cmdline::insert(const gchar *src)
 
 			/* error is handled in Cmdline::keypress() */
 			throw;
+		} catch (...) {
+			ViewCurrent::end_snapshot();
+			throw;
 		}
 
 		pc++;
@@ -47,6 +47,10 @@ Document::edit(ViewCurrent &view)
 
 	maybe_create_document();
 
+	if (view.ssm(SCI_GETDOCPOINTER) != (sptr_t)doc)
+		/* undo collection is suspended per document */
+		ViewCurrent::end_snapshot(&view);
+
 	view.ssm(SCI_SETLAYOUTCACHE, SC_CACHE_NONE);
 
 	view.ssm(SCI_SETDOCPOINTER, 0, (sptr_t)doc);
@@ -19,6 +19,8 @@
 #include "config.h"
 #endif
 
+#include <errno.h>
+
 #include <glib.h>
 
 #include "sciteco.h"
@@ -32,13 +34,12 @@ namespace SciTECO {
  *
  * This gets the next data block from the converter
  * implementation, performs EOL translation (if enabled)
- * in a more or less efficient manner and returns
- * a chunk of EOL-normalized data.
+ * and returns the EOL-normalized block.
  *
+ * EOL translation is performed in place, i.e. the
+ * data source's buffer is modified.
  * Since the underlying data source may have to be
- * queried repeatedly and because EOLReader avoids
- * reassembling the EOL-normalized data by returning
- * references into the modified data source, it is
+ * queried repeatedly, it is
  * necessary to call this function repeatedly until
  * it returns NULL.
  *
@@ -55,46 +56,49 @@ namespace SciTECO {
 const gchar *
 EOLReader::convert(gsize &data_len)
 {
-	if (last_char < 0) {
-		/* a CRLF was last translated */
-		block_len++;
-		last_char = '\n';
-	}
-	offset += block_len;
+	gchar *p, *end, *out, *block;
 
-	if (offset == read_len) {
-		offset = 0;
+	/*
+	 * NOTE: This throws in case of errors
+	 */
+	if (!this->read(buffer, read_len)) {
+		/* EOF */
+		if (last_char == '\r')
+			/*
+			 * Very last character read is CR.
+			 * If this is the only EOL so far, the
+			 * EOL style is MAC.
+			 */
+			add_eol(SC_EOL_CR);
 
+		return NULL;
+	}
+
+	if (!(Flags::ed & Flags::ED_AUTOEOL)) {
 		/*
-		 * NOTE: This throws in case of errors
+		 * No EOL translation - always return entire
+		 * buffer
 		 */
-		if (!this->read(buffer, read_len)) {
-			/* EOF */
-			if (last_char == '\r') {
-				/*
-				 * Very last character read is CR.
-				 * If this is the only EOL so far, the
-				 * EOL style is MAC.
-				 * This is also executed if auto-eol is disabled
-				 * but it doesn't hurt.
-				 */
-				if (eol_style < 0)
-					eol_style = SC_EOL_CR;
-				else if (eol_style != SC_EOL_CR)
-					eol_style_inconsistent = TRUE;
-			}
+		data_len = read_len;
+		return buffer;
+	}
 
-			return NULL;
-		}
+	p = block = buffer;
+	end = buffer + read_len;
 
-		if (!(Flags::ed & Flags::ED_AUTOEOL)) {
-			/*
-			 * No EOL translation - always return entire
-			 * buffer
-			 */
-			data_len = block_len = read_len;
-			return buffer;
+	if (last_char == '\r' && p < end) {
+		/*
+		 * The last block ended in CR, which has
+		 * already been returned as LF.
+		 */
+		if (*p == '\n') {
+			add_eol(SC_EOL_CRLF);
+			/* the block simply starts after the LF */
+			block = ++p;
+		} else {
+			add_eol(SC_EOL_CR);
 		}
+		last_char = 0;
 	}
 
 	/*
@@ -102,94 +106,83 @@ EOLReader::convert(gsize &data_len)
 	 * Every EOL sequence is normalized to LF and
 	 * the first sequence determines the documents
 	 * EOL style.
-	 * This loop is executed for every byte of the
+	 * This is executed for every byte of the
 	 * file/stream, so it was important to optimize
-	 * it. Specifically, the number of returns
-	 * is minimized by keeping a pointer to
-	 * the beginning of a block of data in the buffer
-	 * which already has LFs (offset).
-	 * Mac EOLs can be converted to UNIX EOLs directly
-	 * in the buffer.
-	 * So if their EOLs are consistent, the function
-	 * will return one block for the entire buffer.
-	 * When reading a file with DOS EOLs, there will
-	 * be one call per line which is significantly slower.
+	 * it. Instead of looking at every byte, we search
+	 * for CRs with memchr() which is usually vectorized
+	 * by the C library.
+	 * CRs are converted to LF and the LFs of CRLF sequences
+	 * are removed by moving the following data down in the
+	 * buffer, so the entire buffer is always returned as
+	 * one block, regardless of the EOL style.
+	 * Lone LFs only have to be searched for as long as
+	 * they could change the EOL style guessed so far.
 	 */
-	for (guint i = offset; i < read_len; i++) {
-		switch (buffer[i]) {
-		case '\n':
-			if (last_char == '\r') {
-				if (eol_style < 0)
-					eol_style = SC_EOL_CRLF;
-				else if (eol_style != SC_EOL_CRLF)
-					eol_style_inconsistent = TRUE;
-
-				/*
-				 * Return block. CR has already
-				 * been made LF in `buffer`.
-				 */
-				data_len = block_len = i-offset;
-				/* next call will skip the CR */
-				last_char = -1;
-				return buffer + offset;
-			}
+	out = p;
+	for (;;) {
+		gchar *cr = (gchar *)memchr(p, '\r', end - p);
+		gchar *segment_end = cr ? cr : end;
 
-			if (eol_style < 0)
-				eol_style = SC_EOL_LF;
-			else if (eol_style != SC_EOL_LF)
-				eol_style_inconsistent = TRUE;
-			/*
-			 * No conversion necessary and no need to
-			 * return block yet.
-			 */
-			last_char = '\n';
+		if ((eol_style < 0 ||
+		     (eol_style != SC_EOL_LF && !eol_style_inconsistent)) &&
+		    memchr(p, '\n', segment_end - p))
+			add_eol(SC_EOL_LF);
+
+		if (out != p)
+			memmove(out, p, segment_end - p);
+		out += segment_end - p;
+
+		if (!cr)
 			break;
 
-		case '\r':
-			if (last_char == '\r') {
-				if (eol_style < 0)
-					eol_style = SC_EOL_CR;
-				else if (eol_style != SC_EOL_CR)
-					eol_style_inconsistent = TRUE;
-			}
+		*out++ = '\n';
+		p = cr + 1;
 
-			/*
-			 * Convert CR to LF in `buffer`.
-			 * This way more than one line using
-			 * Mac EOLs can be returned at once.
-			 */
-			buffer[i] = '\n';
+		if (p == end) {
+			/* whether this is a CRLF is decided by the next block */
 			last_char = '\r';
 			break;
+		}
 
-		default:
-			if (last_char == '\r') {
-				if (eol_style < 0)
-					eol_style = SC_EOL_CR;
-				else if (eol_style != SC_EOL_CR)
-					eol_style_inconsistent = TRUE;
-			}
-			last_char = buffer[i];
-			break;
+		if (*p == '\n') {
+			add_eol(SC_EOL_CRLF);
+			p++;
+		} else {
+			add_eol(SC_EOL_CR);
 		}
 	}
 
-	/*
-	 * Return remaining block.
-	 * With UNIX/MAC EOLs, this will usually be the
-	 * entire `buffer`
-	 */
-	data_len = block_len = read_len-offset;
-	return buffer + offset;
+	data_len = out - block;
+	return block;
+}
+
+EOLReaderGIO::~EOLReaderGIO()
+{
+	set_channel();
+	g_free(buffer);
 }
 
 bool
-EOLReaderGIO::read(gchar *buffer, gsize &read_len)
+EOLReaderGIO::read(gchar *&buffer, gsize &read_len)
 {
 	GError *error = NULL;
 
-	switch (g_io_channel_read_chars(channel, buffer,
-	                                sizeof(EOLReaderGIO::buffer),
+	if (!block_size) {
+		block_size = EOL_READER_BLOCK_MIN;
+		buffer = (gchar *)g_malloc(block_size);
+	} else if (read_len == block_size &&
+	           block_size < EOL_READER_BLOCK_MAX) {
+		/*
+		 * The last read filled the buffer, so there is
+		 * probably a lot more data to come.
+		 * The old contents have already been consumed.
+		 */
+		block_size *= 2;
+		g_free(buffer);
+		buffer = (gchar *)g_malloc(block_size);
+	}
+
+	switch (g_io_channel_read_chars(channel, buffer, block_size,
 	                                &read_len, &error)) {
 	case G_IO_STATUS_ERROR:
 		throw GlibError(error);
@@ -204,13 +197,21 @@ EOLReaderGIO::read(gchar *buffer, gsize &read_len)
 }
 
 bool
-EOLReaderMem::read(gchar *buffer, gsize &read_len)
+EOLReaderMem::read(gchar *&buffer, gsize &read_len)
 {
-	read_len = buffer_len;
-	buffer_len = 0;
 	/*
-	 * On the first call, returns true,
-	 * later false (no more data).
+	 * Continue after the last block.
+	 * Since EOL translation only modifies the block
+	 * being converted, the blocks returned previously
+	 * remain valid.
+	 */
+	buffer += read_len;
+	read_len = MIN(buffer_len, block_size);
+	buffer_len -= read_len;
+
+	/*
+	 * By default, returns true on the first call
+	 * and later false (no more data).
 	 */
 	return read_len != 0;
 }
@@ -254,9 +255,8 @@ EOLReaderMem::convert_all(gsize *out_len)
 gsize
 EOLWriter::convert(const gchar *buffer, gsize buffer_len)
 {
-	gsize bytes_written;
-	guint i = 0;
-	guint block_start;
+	const gchar *p, *end, *block;
+	const gchar *cr, *lf;
 	gsize block_written;
 
 	if (!(Flags::ed & Flags::ED_AUTOEOL))
@@ -273,61 +273,119 @@ EOLWriter::convert(const gchar *buffer, gsize buffer_len)
 	 * when its content was read in (presumably from a file)
 	 * but might have been changed manually by the user.
 	 * NOTE: This code assumes that the output stream is
-	 * buffered, since otherwise it would be slower
+	 * buffered or collects blocks (cf. EOLWriterFd),
+	 * since otherwise it would be slower
 	 * (has been benchmarked).
-	 * NOTE: The loop is executed for every character
-	 * in `buffer` and has been optimized for minimal
-	 * function (i.e. GIOChannel) calls.
+	 * NOTE: Instead of inspecting every character in
+	 * `buffer`, the next CR and LF are searched with
+	 * memchr() which is usually vectorized by the C library.
+	 * The lines between them are written directly from
+	 * `buffer`.
 	 */
-	bytes_written = 0;
+	p = buffer;
 	if (state == STATE_WRITE_LF) {
 		/* complete writing a CRLF sequence */
 		if (this->write("\n", 1) < 1)
 			return 0;
 		state = STATE_START;
-		bytes_written++;
-		i++;
+		p++;
+	}
+
+	end = buffer + buffer_len;
+
+	if (eol_seq_len == 1 && *eol_seq == '\n') {
+		/*
+		 * LFs do not have to be translated, so they are
+		 * written as part of the blocks and only CRs
+		 * break them up.
+		 * This is the common case and without any CR,
+		 * the entire buffer is written as a single block.
+		 */
+		if (p < end && *p == '\n' && last_c == '\r')
+			/* LF of a CRLF split between buffers */
+			p++;
+		block = p;
+
+		while ((cr = (const gchar *)memchr(block, '\r', end - block))) {
+			block_written = this->write(block, cr - block);
+			if (block_written < (gsize)(cr - block)) {
+				p = block + block_written;
+				goto incomplete_lf;
+			}
+
+			/* the LF of a CRLF begins the next block */
+			block = cr+1;
+			if (block < end && *block == '\n')
+				continue;
+
+			if (this->write("\n", 1) < 1) {
+				p = cr;
+				goto incomplete;
+			}
+		}
+
+		p = block + this->write(block, end - block);
+
+incomplete_lf:
+		/*
+		 * The CR of a CRLF is only consumed along with its LF,
+		 * since the LF is skipped if the next buffer
+		 * begins with it.
+		 */
+		if (p > buffer && p < end && *p == '\n' && p[-1] == '\r')
+			p--;
+		goto incomplete;
 	}
 
-	block_start = i;
-	while (i < buffer_len) {
-		switch (buffer[i]) {
-		case '\n':
-			if (last_c == '\r') {
-				/* EOL sequence already written */
-				bytes_written++;
-				block_start = i+1;
-				break;
+	block = p;
+	cr = (const gchar *)memchr(p, '\r', end - p);
+	lf = (const gchar *)memchr(p, '\n', end - p);
+
+	while (cr || lf) {
+		const gchar *eol = cr && (!lf || cr < lf) ? cr : lf;
+
+		/*
+		 * For the LF of a CRLF, the EOL sequence has
+		 * already been written.
+		 */
+		if (*eol == '\r' ||
+		    (eol > buffer ? eol[-1] : last_c) != '\r') {
+			block_written = this->write(block, eol - block);
+			if (block_written < (gsize)(eol - block)) {
+				p = block + block_written;
+				goto incomplete;
 			}
-			/* fall through */
-		case '\r':
-			block_written = this->write(buffer+block_start, i-block_start);
-			bytes_written += block_written;
-			if (block_written < i-block_start)
-				return bytes_written;
 
 			block_written = this->write(eol_seq, eol_seq_len);
-			if (block_written == 0)
-				return bytes_written;
 			if (block_written < eol_seq_len) {
-				/* incomplete EOL seq - we have written CR of CRLF */
-				state = STATE_WRITE_LF;
-				return bytes_written;
+				/* we might have written CR of CRLF */
+				if (block_written > 0)
+					state = STATE_WRITE_LF;
+				p = eol;
+				goto incomplete;
 			}
-			bytes_written++;
-
-			block_start = i+1;
-			break;
 		}
 
-		last_c = buffer[i++];
+		block = eol+1;
+		if (eol == cr)
+			cr = (const gchar *)memchr(block, '\r', end - block);
+		else
+			lf = (const gchar *)memchr(block, '\n', end - block);
 	}
 
 	/*
 	 * Write out remaining block (i.e. line)
 	 */
-	bytes_written += this->write(buffer+block_start, buffer_len-block_start);
-	return bytes_written;
+	p = block + this->write(block, end - block);
+
+incomplete:
+	/*
+	 * The caller will continue at `p`, so this is
+	 * the last character consumed.
+	 */
+	if (p > buffer)
+		last_c = p[-1];
+	return p - buffer;
 }
 
 gsize
@@ -349,6 +407,64 @@ EOLWriterGIO::write(const gchar *buffer, gsize buffer_len)
 	return bytes_written;
 }
 
+#ifdef HAVE_WRITEV
+
+gsize
+EOLWriterFd::write(const gchar *buffer, gsize buffer_len)
+{
+	if (!buffer_len)
+		return 0;
+
+	if (iov_len == G_N_ELEMENTS(iov))
+		flush();
+
+	iov[iov_len].iov_base = (gpointer)buffer;
+	iov[iov_len].iov_len = buffer_len;
+	iov_len++;
+
+	return buffer_len;
+}
+
+/**
+ * Write all blocks collected so far.
+ *
+ * This must be called after converting the last block
+ * and before the converted buffers become invalid.
+ * Errors are propagated as exceptions.
+ */
+void
+EOLWriterFd::flush(void)
+{
+	struct iovec *cur = iov;
+	guint cur_len = iov_len;
+
+	while (cur_len > 0) {
+		ssize_t rc = writev(fd, cur, cur_len);
+
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			iov_len = 0;
+			throw Error("%s", g_strerror(errno));
+		}
+
+		/* skip the vectors that have been written completely */
+		while (cur_len > 0 && (gsize)rc >= cur->iov_len) {
+			rc -= cur->iov_len;
+			cur++;
+			cur_len--;
+		}
+		if (cur_len > 0) {
+			cur->iov_base = (gchar *)cur->iov_base + rc;
+			cur->iov_len -= rc;
+		}
+	}
+
+	iov_len = 0;
+}
+
+#endif /* HAVE_WRITEV */
+
 gsize
 EOLWriterMem::write(const gchar *buffer, gsize buffer_len)
 {
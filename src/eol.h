@@ -19,6 +19,11 @@
 #define __EOL_H
 
 #include <string.h>
+#include <limits.h>
+
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
 
 #include <glib.h>
 
@@ -28,38 +33,76 @@
 namespace SciTECO {
 
 class EOLReader : public Object {
-	gchar *buffer;
 	gsize read_len;
-	guint offset;
-	gsize block_len;
 	gint last_char;
 
+	/**
+	 * Register an EOL sequence of the given style.
+	 * The first one determines the EOL style.
+	 */
+	inline void
+	add_eol(gint style)
+	{
+		if (eol_style < 0)
+			eol_style = style;
+		else if (eol_style != style)
+			eol_style_inconsistent = TRUE;
+	}
+
+protected:
+	gchar *buffer;
+
 public:
 	gint eol_style;
 	gboolean eol_style_inconsistent;
 
 	EOLReader(gchar *_buffer)
-	         : buffer(_buffer),
-	           read_len(0), offset(0), block_len(0),
-	           last_char(0), eol_style(-1),
+	         : read_len(0), last_char(0),
+	           buffer(_buffer), eol_style(-1),
 	           eol_style_inconsistent(FALSE) {}
 	virtual ~EOLReader() {}
 
 	const gchar *convert(gsize &data_len);
 
 protected:
-	virtual bool read(gchar *buffer, gsize &read_len) = 0;
+	/**
+	 * Read the next block of data.
+	 *
+	 * @param buffer Where to read data to.
+	 *               Implementations may replace the buffer,
+	 *               since all data has been consumed when
+	 *               read() is called.
+	 * @param read_len Set to the number of bytes read.
+	 * @return false at the end of data.
+	 */
+	virtual bool read(gchar *&buffer, gsize &read_len) = 0;
 };
 
+/**
+ * Initial block size of EOLReaderGIO in bytes.
+ */
+#define EOL_READER_BLOCK_MIN (64*1024)
+/**
+ * Maximum block size of EOLReaderGIO in bytes.
+ */
+#define EOL_READER_BLOCK_MAX (4*1024*1024)
+
 class EOLReaderGIO : public EOLReader {
-	gchar buffer[1024];
+	/**
+	 * Size of the current read buffer.
+	 * It grows as long as reads fill the buffer
+	 * completely, so large files can be read with few
+	 * system calls while short reads from pipes
+	 * do not waste memory.
+	 */
+	gsize block_size;
 	GIOChannel *channel;
 
-	bool read(gchar *buffer, gsize &read_len);
+	bool read(gchar *&buffer, gsize &read_len);
 
 public:
 	EOLReaderGIO(GIOChannel *_channel = NULL)
-	            : EOLReader(buffer), channel(NULL)
+	            : EOLReader(NULL), block_size(0), channel(NULL)
 	{
 		set_channel(_channel);
 	}
@@ -74,20 +117,22 @@ public:
 			g_io_channel_ref(channel);
 	}
 
-	~EOLReaderGIO()
-	{
-		set_channel();
-	}
+	~EOLReaderGIO();
 };
 
 class EOLReaderMem : public EOLReader {
+	/** Number of bytes not yet read */
 	gsize buffer_len;
+	/** Maximum number of bytes to convert at once */
+	gsize block_size;
 
-	bool read(gchar *buffer, gsize &read_len);
+	bool read(gchar *&buffer, gsize &read_len);
 
 public:
-	EOLReaderMem(gchar *buffer, gsize _buffer_len)
-	            : EOLReader(buffer), buffer_len(_buffer_len) {}
+	EOLReaderMem(gchar *buffer, gsize _buffer_len,
+	             gsize _block_size = G_MAXSIZE)
+	            : EOLReader(buffer), buffer_len(_buffer_len),
+	              block_size(_block_size) {}
 
 	gchar *convert_all(gsize *out_len = NULL);
 };
@@ -146,6 +191,42 @@ public:
 	}
 };
 
+#ifdef HAVE_WRITEV
+
+/**
+ * Maximum number of blocks collected by EOLWriterFd
+ * before writing them.
+ */
+#if defined(IOV_MAX) && IOV_MAX < 1024
+#define EOL_WRITER_IOV_MAX IOV_MAX
+#else
+#define EOL_WRITER_IOV_MAX 1024
+#endif
+
+/**
+ * Writer to a file descriptor, which does not copy data.
+ * Instead, it collects the blocks to write (pointing into
+ * the converted buffers) and writes them with writev(2).
+ * Therefore, flush() must be called before the converted
+ * buffers become invalid.
+ */
+class EOLWriterFd : public EOLWriter {
+	int fd;
+
+	struct iovec iov[EOL_WRITER_IOV_MAX];
+	guint iov_len;
+
+	gsize write(const gchar *buffer, gsize buffer_len);
+
+public:
+	EOLWriterFd(int _fd, gint eol_mode)
+	           : EOLWriter(eol_mode), fd(_fd), iov_len(0) {}
+
+	void flush(void);
+};
+
+#endif /* HAVE_WRITEV */
+
 class EOLWriterMem : public EOLWriter {
 	GString *str;
 
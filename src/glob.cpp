@@ -25,6 +25,10 @@
 #include <glib/gprintf.h>
 #include <glib/gstdio.h>
 
+#ifdef HAVE_DIRENT_H
+#include <dirent.h>
+#endif
+
 #include "sciteco.h"
 #include "interface.h"
 #include "parser.h"
@@ -33,6 +37,7 @@
 #include "ring.h"
 #include "ioview.h"
 #include "glob.h"
+#include "workers.h"
 
 namespace SciTECO {
 
@@ -41,11 +46,411 @@ namespace States {
 	StateGlob_filename	glob_filename;
 }
 
+/**
+ * Regular expression character set of directory
+ * separators.
+ */
+#ifdef G_OS_WIN32
+#define GLOB_SEPARATORS "/\\\\"
+#else
+#define GLOB_SEPARATORS "/"
+#endif
+
+/**
+ * Type of a directory entry as far as it is known
+ * without stat()ing the file.
+ */
+enum DirEntryType {
+	DIR_ENTRY_UNKNOWN,
+	DIR_ENTRY_REGULAR,
+	DIR_ENTRY_DIR,
+	DIR_ENTRY_SYMLINK,
+	DIR_ENTRY_OTHER
+};
+
+/**
+ * Reads the entries of a directory.
+ *
+ * Where supported, the entry types reported by readdir(3)
+ * are used, so most file tests do not require a stat().
+ * Otherwise, GDir is used and the entry types are unknown.
+ *
+ * Worker threads must allocate it on the stack,
+ * since Object's memory accounting is not thread-safe.
+ * DirReader itself does not allocate memory via
+ * C++ operators.
+ */
+class DirReader : public Object {
+#ifdef HAVE_STRUCT_DIRENT_D_TYPE
+	DIR *dir;
+#else
+	GDir *dir;
+#endif
+
+public:
+	DirReader(const gchar *path)
+	{
+#ifdef HAVE_STRUCT_DIRENT_D_TYPE
+		dir = opendir(path);
+#else
+		dir = g_dir_open(path, 0, NULL);
+#endif
+		/* if path does not exist, dir may be NULL */
+	}
+
+	~DirReader()
+	{
+		if (!dir)
+			return;
+#ifdef HAVE_STRUCT_DIRENT_D_TYPE
+		closedir(dir);
+#else
+		g_dir_close(dir);
+#endif
+	}
+
+	const gchar *read(DirEntryType &type);
+};
+
+/**
+ * Read the next directory entry.
+ *
+ * @param type Set to the type of the entry.
+ * @return The entry's name, excluding "." and "..".
+ *         NULL if there are no more entries.
+ *         It is valid until the next call.
+ */
+const gchar *
+DirReader::read(DirEntryType &type)
+{
+#ifdef HAVE_STRUCT_DIRENT_D_TYPE
+	struct dirent *entry;
+
+	if (!dir)
+		return NULL;
+
+	while ((entry = readdir(dir))) {
+		const gchar *name = entry->d_name;
+
+		if (name[0] == '.' &&
+		    (!name[1] || (name[1] == '.' && !name[2])))
+			continue;
+
+		switch (entry->d_type) {
+		case DT_UNKNOWN: type = DIR_ENTRY_UNKNOWN; break;
+		case DT_REG:     type = DIR_ENTRY_REGULAR; break;
+		case DT_DIR:     type = DIR_ENTRY_DIR; break;
+		case DT_LNK:     type = DIR_ENTRY_SYMLINK; break;
+		default:         type = DIR_ENTRY_OTHER; break;
+		}
+
+		return name;
+	}
+
+	return NULL;
+#else
+	type = DIR_ENTRY_UNKNOWN;
+	return dir ? g_dir_read_name(dir) : NULL;
+#endif
+}
+
+/**
+ * Perform a file test, avoiding the stat()
+ * if the directory entry type is sufficient.
+ * A test of 0 means no file testing.
+ */
+static bool
+test_entry(const gchar *filename, DirEntryType type, GFileTest test)
+{
+	switch ((gint)test) {
+	case 0:
+		return true;
+	case G_FILE_TEST_EXISTS:
+		/* symlinks may be dangling */
+		if (type == DIR_ENTRY_UNKNOWN || type == DIR_ENTRY_SYMLINK)
+			break;
+		return true;
+	case G_FILE_TEST_IS_REGULAR:
+	case G_FILE_TEST_IS_DIR:
+		/* symlinks must be resolved */
+		if (type == DIR_ENTRY_UNKNOWN || type == DIR_ENTRY_SYMLINK)
+			break;
+		return test == G_FILE_TEST_IS_REGULAR
+			? type == DIR_ENTRY_REGULAR : type == DIR_ENTRY_DIR;
+	case G_FILE_TEST_IS_SYMLINK:
+		if (type == DIR_ENTRY_UNKNOWN)
+			break;
+		return type == DIR_ENTRY_SYMLINK;
+	default:
+		break;
+	}
+
+	return g_file_test(filename, test);
+}
+
+/**
+ * Walks a directory tree, possibly with several
+ * threads, collecting all file names whose path relative
+ * to the root directory matches a pattern.
+ *
+ * Symbolic links to directories are not followed,
+ * so there cannot be any cycles.
+ */
+class GlobWalker {
+	const gchar *root;
+	gsize root_len;
+	GRegex *pattern;
+	GFileTest test;
+
+	/** Directories still to walk, relative to root */
+	GQueue pending;
+	/** Matching file names */
+	GPtrArray *results;
+
+	/** Whether walking has been interrupted */
+	gboolean interrupted;
+
+#if GLIB_CHECK_VERSION(2,36,0)
+	/** Number of directories currently being walked */
+	guint busy;
+
+	GMutex mutex;
+	GCond cond;
+
+	static gpointer worker(gpointer data);
+#endif
+
+	void walk(const gchar *dir, GQueue &subdirs, GPtrArray *matches) const;
+
+public:
+	GlobWalker(const gchar *_root, GRegex *_pattern, GFileTest _test);
+	~GlobWalker();
+
+	GPtrArray *run(void);
+};
+
+GlobWalker::GlobWalker(const gchar *_root, GRegex *_pattern, GFileTest _test)
+                      : root(_root), root_len(strlen(_root)),
+                        pattern(_pattern), test(_test)
+{
+	g_queue_init(&pending);
+	results = g_ptr_array_new();
+	interrupted = FALSE;
+
+#if GLIB_CHECK_VERSION(2,36,0)
+	busy = 0;
+	g_mutex_init(&mutex);
+	g_cond_init(&cond);
+#endif
+}
+
+GlobWalker::~GlobWalker()
+{
+	gchar *dir;
+
+	while ((dir = (gchar *)g_queue_pop_head(&pending)))
+		g_free(dir);
+
+	if (results) {
+		for (guint i = 0; i < results->len; i++)
+			g_free(g_ptr_array_index(results, i));
+		g_ptr_array_free(results, TRUE);
+	}
+
+#if GLIB_CHECK_VERSION(2,36,0)
+	g_cond_clear(&cond);
+	g_mutex_clear(&mutex);
+#endif
+}
+
+/**
+ * Read a single directory.
+ *
+ * This may be called from worker threads.
+ *
+ * @param dir Directory relative to root, including
+ *            a trailing directory separator (or empty).
+ * @param subdirs Queue to append subdirectories to.
+ * @param matches Array to append matching file names to.
+ */
+void
+GlobWalker::walk(const gchar *dir, GQueue &subdirs, GPtrArray *matches) const
+{
+	gchar *path = g_strconcat(root, dir, NIL);
+	DirReader reader(*path ? path : ".");
+	const gchar *basename;
+	DirEntryType type;
+
+	while ((basename = reader.read(type))) {
+		gchar *filename = g_strconcat(path, basename, NIL);
+
+		if (type == DIR_ENTRY_DIR ||
+		    (type == DIR_ENTRY_UNKNOWN &&
+		     g_file_test(filename, G_FILE_TEST_IS_DIR) &&
+		     !g_file_test(filename, G_FILE_TEST_IS_SYMLINK)))
+			g_queue_push_tail(&subdirs,
+			                  g_strconcat(filename + root_len,
+			                              G_DIR_SEPARATOR_S, NIL));
+
+		/*
+		 * The pattern is matched against the path
+		 * relative to root.
+		 */
+		if (g_regex_match(pattern, filename + root_len,
+		                  (GRegexMatchFlags)0, NULL) &&
+		    test_entry(filename, type, test))
+			g_ptr_array_add(matches, filename);
+		else
+			g_free(filename);
+	}
+
+	g_free(path);
+}
+
+static gint
+compare_filenames(gconstpointer a, gconstpointer b)
+{
+	return strcmp(*(const gchar **)a, *(const gchar **)b);
+}
+
+#if GLIB_CHECK_VERSION(2,36,0)
+
+gpointer
+GlobWalker::worker(gpointer data)
+{
+	GlobWalker *ctx = (GlobWalker *)data;
+	GQueue subdirs = G_QUEUE_INIT;
+	GPtrArray *matches = g_ptr_array_new();
+	gchar *dir;
+
+	g_mutex_lock(&ctx->mutex);
+
+	for (;;) {
+		while (!ctx->interrupted &&
+		       g_queue_is_empty(&ctx->pending) && ctx->busy > 0)
+			g_cond_wait(&ctx->cond, &ctx->mutex);
+		if (ctx->interrupted)
+			break;
+		/* NOTE: nothing pending and nobody could add more */
+		dir = (gchar *)g_queue_pop_head(&ctx->pending);
+		if (!dir)
+			break;
+		ctx->busy++;
+
+		g_mutex_unlock(&ctx->mutex);
+		ctx->walk(dir, subdirs, matches);
+		g_free(dir);
+		g_mutex_lock(&ctx->mutex);
+
+		ctx->busy--;
+		while ((dir = (gchar *)g_queue_pop_head(&subdirs)))
+			g_queue_push_tail(&ctx->pending, dir);
+		for (guint i = 0; i < matches->len; i++)
+			g_ptr_array_add(ctx->results,
+			                g_ptr_array_index(matches, i));
+		g_ptr_array_set_size(matches, 0);
+
+		/* the remaining directories are left pending */
+		if (interface.is_interrupted())
+			ctx->interrupted = TRUE;
+
+		g_cond_broadcast(&ctx->cond);
+	}
+
+	g_mutex_unlock(&ctx->mutex);
+
+	g_ptr_array_free(matches, TRUE);
+	return NULL;
+}
+
+/**
+ * Walk the directory tree.
+ *
+ * Walking can be interrupted.
+ *
+ * @return Array of matching file names, sorted so
+ *         the order does not depend on the order
+ *         of directory entries or on thread scheduling.
+ *         The file names must be freed with g_free().
+ *         NULL if walking has been interrupted.
+ */
+GPtrArray *
+GlobWalker::run(void)
+{
+	GPtrArray *ret;
+
+	g_queue_push_tail(&pending, g_strdup(""));
+
+	workers.run(worker, this, G_MAXUINT);
+
+	if (interrupted)
+		return NULL;
+
+	g_ptr_array_sort(results, compare_filenames);
+
+	ret = results;
+	results = NULL;
+	return ret;
+}
+
+#else /* !GLIB_CHECK_VERSION(2,36,0) */
+
+GPtrArray *
+GlobWalker::run(void)
+{
+	gchar *dir;
+	GPtrArray *ret;
+
+	g_queue_push_tail(&pending, g_strdup(""));
+
+	while ((dir = (gchar *)g_queue_pop_head(&pending))) {
+		walk(dir, pending, results);
+		g_free(dir);
+
+		if (interface.is_interrupted())
+			return NULL;
+	}
+
+	g_ptr_array_sort(results, compare_filenames);
+
+	ret = results;
+	results = NULL;
+	return ret;
+}
+
+#endif
+
 Globber::Globber(const gchar *pattern, GFileTest _test)
-                : test(_test)
+                : test(_test), dir(NULL), results(NULL), next_result(0)
 {
 	gsize dirname_len;
 
+	if (is_recursive(pattern)) {
+		/*
+		 * The directory to walk is made up of all
+		 * components up to the first one with wildcards.
+		 * The remaining components are matched against
+		 * paths relative to it.
+		 */
+		dirname_len = 0;
+		for (const gchar *p = pattern; *p && !strchr("*?[", *p); p++)
+			if (G_IS_DIR_SEPARATOR(*p))
+				dirname_len = p - pattern + 1;
+		dirname = g_strndup(pattern, dirname_len);
+
+		Globber::pattern = compile_pattern(pattern + dirname_len, true);
+
+		GlobWalker walker(dirname, Globber::pattern, test);
+		results = walker.run();
+		if (!results) {
+			/* the destructor is not called */
+			g_regex_unref(Globber::pattern);
+			g_free(dirname);
+			throw Error("Interrupted");
+		}
+		return;
+	}
+
 	/*
 	 * This finds the directory component including
 	 * any trailing directory separator
@@ -58,21 +463,39 @@ Globber::Globber(const gchar *pattern, GFileTest _test)
 	dirname_len = file_get_dirname_len(pattern);
 	dirname = g_strndup(pattern, dirname_len);
 
-	dir = g_dir_open(*dirname ? dirname : ".", 0, NULL);
-	/* if dirname does not exist, dir may be NULL */
+	dir = new DirReader(*dirname ? dirname : ".");
 
 	Globber::pattern = compile_pattern(pattern + dirname_len);
 }
 
+/**
+ * Check whether a pattern contains a "**" wildcard
+ * as an entire path component, so it matches
+ * recursively.
+ */
+bool
+Globber::is_recursive(const gchar *pattern)
+{
+	for (const gchar *p = pattern; (p = strstr(p, "**")); p += 2)
+		if ((p == pattern || G_IS_DIR_SEPARATOR(p[-1])) &&
+		    (!p[2] || G_IS_DIR_SEPARATOR(p[2])))
+			return true;
+
+	return false;
+}
+
 gchar *
 Globber::next(void)
 {
 	const gchar *basename;
+	DirEntryType type;
 
-	if (!dir)
-		return NULL;
+	if (results)
+		return next_result < results->len
+			? (gchar *)g_ptr_array_index(results, next_result++)
+			: NULL;
 
-	while ((basename = g_dir_read_name(dir))) {
+	while ((basename = dir->read(type))) {
 		gchar *filename;
 
 		if (!g_regex_match(pattern, basename, (GRegexMatchFlags)0, NULL))
@@ -84,11 +507,7 @@ Globber::next(void)
 		 */
 		filename = g_strconcat(dirname, basename, NIL);
 
-		/*
-		 * No need to perform file test for EXISTS since
-		 * g_dir_read_name() will only return existing entries
-		 */
-		if (test == G_FILE_TEST_EXISTS || g_file_test(filename, test))
+		if (test_entry(filename, type, test))
 			return filename;
 
 		g_free(filename);
@@ -99,10 +518,14 @@ Globber::next(void)
 
 Globber::~Globber()
 {
+	if (results) {
+		while (next_result < results->len)
+			g_free(g_ptr_array_index(results, next_result++));
+		g_ptr_array_free(results, TRUE);
+	}
 	if (pattern)
 		g_regex_unref(pattern);
-	if (dir)
-		g_dir_close(dir);
+	delete dir;
 	g_free(dirname);
 }
 
@@ -161,12 +584,17 @@ Globber::escape_pattern(const gchar *pattern)
  * do not allow escaping.
  *
  * @param pattern The pattern to compile.
+ * @param pathname Whether the pattern is matched against
+ *                 paths, so that wildcards do not match directory
+ *                 separators and "**" components match any number
+ *                 of directories.
  * @return A new compiled regular expression object.
  *         Always non-NULL. Unref after use.
  */
 GRegex *
-Globber::compile_pattern(const gchar *pattern)
+Globber::compile_pattern(const gchar *pattern, bool pathname)
 {
+	const gchar *pattern_start = pattern;
 	gchar *pattern_regex, *pout;
 	GRegex *pattern_compiled;
 
@@ -179,7 +607,8 @@ Globber::compile_pattern(const gchar *pattern)
 
 	/*
 	 * NOTE: The conversion to regex needs at most two
-	 * characters per input character and the regex pattern
+	 * characters per input character (eight when matching
+	 * pathnames) and the regex pattern
 	 * is required only temporarily, so we use a fixed size
 	 * buffer avoiding reallocations but wasting a few bytes
 	 * (determining the exact required space would be tricky).
@@ -187,7 +616,8 @@ Globber::compile_pattern(const gchar *pattern)
 	 * might be arbitrary user input and we must avoid
 	 * stack overflows at all costs.
 	 */
-	pout = pattern_regex = (gchar *)g_malloc(strlen(pattern)*2 + 1 + 1);
+	pout = pattern_regex = (gchar *)g_malloc(strlen(pattern)*(pathname ? 8 : 2) +
+	                                         1 + 1);
 
 	while (*pattern) {
 		if (state == STATE_WILDCARD) {
@@ -196,11 +626,35 @@ Globber::compile_pattern(const gchar *pattern)
 			 */
 			switch (*pattern) {
 			case '*':
-				*pout++ = '.';
-				*pout++ = '*';
+				if (!pathname) {
+					*pout++ = '.';
+					*pout++ = '*';
+					break;
+				}
+				if (pattern[1] == '*' &&
+				    (pattern == pattern_start ||
+				     G_IS_DIR_SEPARATOR(pattern[-1]))) {
+					if (!pattern[2]) {
+						/* trailing "**" matches everything */
+						pout = g_stpcpy(pout, ".*");
+						pattern++;
+						break;
+					}
+					if (G_IS_DIR_SEPARATOR(pattern[2])) {
+						/* zero or more directories */
+						pout = g_stpcpy(pout, "(?:[^" GLOB_SEPARATORS "]*"
+						                      "[" GLOB_SEPARATORS "])*");
+						pattern += 2;
+						break;
+					}
+				}
+				pout = g_stpcpy(pout, "[^" GLOB_SEPARATORS "]*");
 				break;
 			case '?':
-				*pout++ = '.';
+				if (pathname)
+					pout = g_stpcpy(pout, "[^" GLOB_SEPARATORS "]");
+				else
+					*pout++ = '.';
 				break;
 			case '[':
 				/*
@@ -216,6 +670,10 @@ Globber::compile_pattern(const gchar *pattern)
 				}
 				/* fall through */
 			default:
+				if (pathname && G_IS_DIR_SEPARATOR(*pattern)) {
+					pout = g_stpcpy(pout, "[" GLOB_SEPARATORS "]");
+					break;
+				}
 				/*
 				 * For simplicity, all non-alphanumeric
 				 * characters are escaped since they could
@@ -323,13 +781,21 @@ Globber::compile_pattern(const gchar *pattern)
  * in the current directory.
  * The resulting file names have the exact same directory
  * component as \fIpattern\fP (if any).
- * Without \fIfilename\fP, EN will currently only match files
+ * Without \fIfilename\fP, EN will usually only match files
  * in the file name component
  * of \fIpattern\fP, not on each component of the path name
  * separately.
  * In other words, EN only looks through the directory
- * of \fIpattern\fP \(em you cannot effectively match
- * multiple directories.
+ * of \fIpattern\fP.
+ * If \fIpattern\fP contains a \(lq**\(rq path component
+ * however, EN globs recursively:
+ * All path components starting with the first one containing
+ * wildcards are matched against the paths of all files
+ * in the corresponding directory and its subdirectories.
+ * For instance, \(lqENsrc\[sl]**\[sl]*.c\fB$$\fP\(rq expands to all
+ * \(lq.c\(rq files below the \(lqsrc\(rq directory.
+ * Recursive globbing returns file names in sorted order
+ * and does not follow symbolic links to directories.
  *
  * If \fIfilename\fP is specified, \fIpattern\fP will only
  * be matched against that single file name.
@@ -337,6 +803,9 @@ Globber::compile_pattern(const gchar *pattern)
  * In this form, \fIpattern\fP is matched against the entire
  * file name, so it is possible to match directory components
  * as well.
+ * If \fIpattern\fP contains a \(lq**\(rq path component,
+ * it is matched just like when globbing recursively,
+ * i.e. the other wildcards do not match directory separators.
  * \fIfilename\fP does not necessarily have to exist in the
  * file system for the match to succeed (unless a file type check
  * is also specified).
@@ -441,7 +910,7 @@ StateGlob_filename::got_file(const gchar *filename)
 	BEGIN_EXEC(&States::start);
 
 	tecoInt teco_test_mode;
-	GFileTest file_flags = G_FILE_TEST_EXISTS;
+	GFileTest file_flags = (GFileTest)0;
 
 	bool matching = false;
 	bool colon_modified = eval_colon();
@@ -454,8 +923,8 @@ StateGlob_filename::got_file(const gchar *filename)
 	switch (teco_test_mode) {
 	/*
 	 * 0 means, no file testing.
-	 * file_flags will still be G_FILE_TEST_EXISTS which
-	 * is equivalent to no testing when using the Globber class.
+	 * file_flags will still be 0 which
+	 * disables testing in the Globber class.
 	 */
 	case 0: break;
 	case 1: file_flags = G_FILE_TEST_IS_REGULAR; break;
@@ -470,68 +939,77 @@ StateGlob_filename::got_file(const gchar *filename)
 
 	pattern_str = glob_reg->get_string();
 
-	if (*filename) {
-		/*
-		 * Match pattern against provided file name
-		 */
-		GRegex *pattern = Globber::compile_pattern(pattern_str);
-
-		if (g_regex_match(pattern, filename, (GRegexMatchFlags)0, NULL) &&
-		    (!teco_test_mode || g_file_test(filename, file_flags))) {
-			if (!colon_modified) {
-				interface.ssm(SCI_BEGINUNDOACTION);
-				interface.ssm(SCI_ADDTEXT, strlen(filename),
-				              (sptr_t)filename);
-				interface.ssm(SCI_ADDTEXT, 1, (sptr_t)"\n");
-				interface.ssm(SCI_SCROLLCARET);
-				interface.ssm(SCI_ENDUNDOACTION);
+	/* NOTE: Globbing may be interrupted */
+	try {
+		if (*filename) {
+			/*
+			 * Match pattern against provided file name
+			 */
+			GRegex *pattern;
+
+			pattern = Globber::compile_pattern(pattern_str,
+			                                   Globber::is_recursive(pattern_str));
+
+			if (g_regex_match(pattern, filename, (GRegexMatchFlags)0, NULL) &&
+			    (!teco_test_mode || g_file_test(filename, file_flags))) {
+				if (!colon_modified) {
+					interface.ssm(SCI_BEGINUNDOACTION);
+					interface.ssm(SCI_ADDTEXT, strlen(filename),
+					              (sptr_t)filename);
+					interface.ssm(SCI_ADDTEXT, 1, (sptr_t)"\n");
+					interface.ssm(SCI_SCROLLCARET);
+					interface.ssm(SCI_ENDUNDOACTION);
+				}
+
+				matching = true;
 			}
 
-			matching = true;
-		}
+			g_regex_unref(pattern);
+		} else if (colon_modified) {
+			/*
+			 * Match pattern against directory contents (globbing),
+			 * returning SUCCESS if at least one file matches
+			 */
+			Globber globber(pattern_str, file_flags);
+			gchar *globbed_filename = globber.next();
 
-		g_regex_unref(pattern);
-	} else if (colon_modified) {
-		/*
-		 * Match pattern against directory contents (globbing),
-		 * returning SUCCESS if at least one file matches
-		 */
-		Globber globber(pattern_str, file_flags);
-		gchar *globbed_filename = globber.next();
+			matching = globbed_filename != NULL;
 
-		matching = globbed_filename != NULL;
+			g_free(globbed_filename);
+		} else {
+			/*
+			 * Match pattern against directory contents (globbing),
+			 * inserting all matching file names (linefeed-terminated)
+			 */
+			Globber globber(pattern_str, file_flags);
 
-		g_free(globbed_filename);
-	} else {
-		/*
-		 * Match pattern against directory contents (globbing),
-		 * inserting all matching file names (linefeed-terminated)
-		 */
-		Globber globber(pattern_str, file_flags);
+			gchar *globbed_filename;
 
-		gchar *globbed_filename;
+			interface.ssm(SCI_BEGINUNDOACTION);
 
-		interface.ssm(SCI_BEGINUNDOACTION);
+			while ((globbed_filename = globber.next())) {
+				size_t len = strlen(globbed_filename);
+				/* overwrite trailing null */
+				globbed_filename[len] = '\n';
 
-		while ((globbed_filename = globber.next())) {
-			size_t len = strlen(globbed_filename);
-			/* overwrite trailing null */
-			globbed_filename[len] = '\n';
+				/*
+				 * FIXME: Once we're 8-bit clean, we should
+				 * add the filenames null-terminated
+				 * (there may be linebreaks in filename).
+				 */
+				interface.ssm(SCI_ADDTEXT, len+1,
+				              (sptr_t)globbed_filename);
 
-			/*
-			 * FIXME: Once we're 8-bit clean, we should
-			 * add the filenames null-terminated
-			 * (there may be linebreaks in filename).
-			 */
-			interface.ssm(SCI_ADDTEXT, len+1,
-			              (sptr_t)globbed_filename);
+				g_free(globbed_filename);
+				matching = true;
+			}
 
-			g_free(globbed_filename);
-			matching = true;
+			interface.ssm(SCI_SCROLLCARET);
+			interface.ssm(SCI_ENDUNDOACTION);
 		}
-
-		interface.ssm(SCI_SCROLLCARET);
-		interface.ssm(SCI_ENDUNDOACTION);
+	} catch (...) {
+		g_free(pattern_str);
+		throw;
 	}
 
 	g_free(pattern_str);
@@ -542,7 +1020,7 @@ StateGlob_filename::got_file(const gchar *filename)
 		/* text has been inserted */
 		ring.dirtify();
 		if (current_doc_must_undo())
-			interface.undo_ssm(SCI_UNDO);
+			interface.undo_modification();
 	}
 
 	glob_reg->undo_set_integer();
@@ -29,12 +29,24 @@
 
 namespace SciTECO {
 
+/** Reader of directory entries, defined in glob.cpp */
+class DirReader;
+
 class Globber : public Object {
 	GFileTest test;
 	gchar *dirname;
-	GDir *dir;
 	GRegex *pattern;
 
+	/** Directory being globbed (non-recursive globbing) */
+	DirReader *dir;
+
+	/**
+	 * Sorted file names found by recursive globbing
+	 * or NULL.
+	 */
+	GPtrArray *results;
+	guint next_result;
+
 public:
 	Globber(const gchar *pattern,
 	        GFileTest test = G_FILE_TEST_EXISTS);
@@ -48,8 +60,11 @@ public:
 		return str && strpbrk(str, "*?[") != NULL;
 	}
 
+	static bool is_recursive(const gchar *pattern);
+
 	static gchar *escape_pattern(const gchar *pattern);
-	static GRegex *compile_pattern(const gchar *pattern);
+	static GRegex *compile_pattern(const gchar *pattern,
+	                               bool pathname = false);
 };
 
 /*
@@ -117,6 +117,7 @@ StateLabel::custom(gchar chr)
 	if (chr == '!') {
 		Goto::table->undo_set(strings[0],
 				      Goto::table->set(strings[0], macro_pc));
+		CachedMacro::record_label(strings[0], macro_pc);
 
 		if (!g_strcmp0(strings[0], Goto::skip_label)) {
 			g_free(undo.push_str(Goto::skip_label));
@@ -125,13 +126,12 @@ StateLabel::custom(gchar chr)
 			undo.push_var(mode) = MODE_NORMAL;
 		}
 
-		g_free(undo.push_str(strings[0]));
-		strings[0] = NULL;
+		g_free(StringArgument::take());
 
 		return &States::start;
 	}
 
-	String::append(undo.push_str(strings[0]), chr);
+	StringArgument::append(chr);
 	return this;
 }
 
@@ -0,0 +1,430 @@
+/*
+ * Copyright (C) 2012-2017 Robin Haberkorn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "sciteco.h"
+#include "interface.h"
+#include "undo.h"
+#include "expressions.h"
+#include "qregisters.h"
+#include "parser.h"
+#include "search.h"
+#include "glob.h"
+#include "grep.h"
+#include "workers.h"
+
+namespace SciTECO {
+
+namespace States {
+	StateGrep		grep;
+	StateGrep_glob		grep_glob;
+	StateGrep_pattern	grep_pattern;
+}
+
+/**
+ * Minimum number of files to search
+ * before using several threads.
+ */
+#define GREP_PARALLEL_MIN 16
+
+/**
+ * Number of bytes searched at once in large files
+ * (see Grep::search()).
+ */
+#define GREP_CHUNK_SIZE (16*1024*1024)
+
+static QRegister *register_argument = NULL;
+static gchar *glob_argument = NULL;
+
+Grep::Grep(const SearchMatcher &_matcher)
+          : matcher(_matcher), next_job(0), cancelled(FALSE)
+{
+	jobs = g_array_new(FALSE, FALSE, sizeof(Job));
+}
+
+Grep::~Grep()
+{
+	for (guint i = 0; i < jobs->len; i++) {
+		Job &job = g_array_index(jobs, Job, i);
+
+		g_free(job.filename);
+		if (job.results)
+			g_string_free(job.results, TRUE);
+	}
+	g_array_free(jobs, TRUE);
+}
+
+/**
+ * Add file to search.
+ *
+ * @param filename File name, which is owned by
+ *                 the Grep object afterwards.
+ */
+void
+Grep::add_file(gchar *filename)
+{
+	Job job;
+
+	job.filename = filename;
+	job.results = NULL;
+	job.skipped = false;
+	g_array_append_val(jobs, job);
+}
+
+/**
+ * Search a single file.
+ *
+ * The file is memory mapped instead of being read,
+ * so only the pages that are actually searched have
+ * to be paged in.
+ * Files that cannot be mapped are silently ignored,
+ * just like file names that do not exist.
+ *
+ * Matchers with a bounded occurrence length
+ * (see SearchMatcher::get_max_len()) search the file
+ * in chunks of at least GREP_CHUNK_SIZE bytes, so files of any
+ * size can be searched and searching can be interrupted
+ * within large files.
+ * Regular expressions are matched against entire files,
+ * which is impossible for files larger than G_MAXINT bytes.
+ * Such files are skipped and run() fails.
+ *
+ * This may be called from worker threads.
+ */
+void
+Grep::search(Job &job)
+{
+	GMappedFile *file;
+	const gchar *contents, *line_start, *p;
+	gsize len, pos = 0;
+	guint line = 1;
+
+	gint max_len = matcher.get_max_len();
+	/*
+	 * Chunks must be longer than the longest occurrence,
+	 * so that every chunk makes progress.
+	 */
+	gsize chunk_size = max_len < 0 ? G_MAXINT
+	                 : MIN(MAX((gsize)GREP_CHUNK_SIZE, (gsize)max_len*2),
+	                       (gsize)G_MAXINT);
+
+	GArray *occurrences;
+
+	file = g_mapped_file_new(job.filename, FALSE, NULL);
+	if (!file)
+		return;
+	contents = g_mapped_file_get_contents(file);
+	len = g_mapped_file_get_length(file);
+	/* NOTE: contents are NULL for empty files */
+	if (!contents || (max_len < 0 && len > chunk_size)) {
+		job.skipped = contents != NULL;
+		g_mapped_file_unref(file);
+		return;
+	}
+
+	occurrences = g_array_new(FALSE, FALSE,
+	                          sizeof(SearchMatcher::Occurrence));
+
+	p = line_start = contents;
+	for (;;) {
+		gsize chunk_len = MIN(len - pos, chunk_size);
+		/*
+		 * Occurrences beginning after `limit` might be
+		 * cut off by the end of the chunk or might hide
+		 * longer occurrences beginning before them.
+		 * They are found again in the next chunk.
+		 * Since chunk_size >= max_len, this cannot underflow.
+		 */
+		gsize limit = pos + chunk_len < len
+				? pos + chunk_len - max_len : len;
+		gsize next_pos = limit + 1;
+
+		g_array_set_size(occurrences, 0);
+		matcher.find_all(contents + pos, chunk_len, G_MAXINT,
+		                 occurrences);
+
+		for (guint i = 0; i < occurrences->len; i++) {
+			SearchMatcher::Occurrence &found =
+				g_array_index(occurrences,
+				              SearchMatcher::Occurrence, i);
+			const gchar *occurrence, *lf;
+
+			if (pos + found.from > limit)
+				break;
+			/* continue with the occurrences following it */
+			next_pos = MAX(next_pos, pos + found.to);
+			occurrence = contents + pos + found.from;
+
+			/* lines are counted incrementally between occurrences */
+			while ((lf = (const gchar *)memchr(p, '\n', occurrence - p))) {
+				line++;
+				p = line_start = lf+1;
+			}
+			p = occurrence;
+
+			if (!job.results)
+				job.results = g_string_new(NULL);
+			g_string_append_printf(job.results, "%s:%u:%" G_GSIZE_FORMAT "\n",
+			                       job.filename, line,
+			                       (gsize)(occurrence - line_start) + 1);
+		}
+
+		if (pos + chunk_len == len)
+			break;
+		pos = next_pos;
+
+		if (interface.is_interrupted()) {
+			g_atomic_int_set(&cancelled, TRUE);
+			break;
+		}
+	}
+
+	g_array_free(occurrences, TRUE);
+	g_mapped_file_unref(file);
+}
+
+#if GLIB_CHECK_VERSION(2,36,0)
+
+gpointer
+Grep::worker(gpointer data)
+{
+	Grep *ctx = (Grep *)data;
+	gint num_jobs = ctx->jobs->len;
+	gint i;
+
+	while (!g_atomic_int_get(&ctx->cancelled) &&
+	       (i = g_atomic_int_add(&ctx->next_job, 1)) < num_jobs) {
+		ctx->search(g_array_index(ctx->jobs, Job, i));
+
+		/* the other workers stop after their current file */
+		if (interface.is_interrupted())
+			g_atomic_int_set(&ctx->cancelled, TRUE);
+	}
+
+	return NULL;
+}
+
+#endif
+
+/**
+ * Search all files, possibly by several threads.
+ *
+ * Searching can be interrupted.
+ * If any file could not be searched, an error is thrown
+ * instead of returning incomplete results.
+ */
+void
+Grep::run(void)
+{
+#if GLIB_CHECK_VERSION(2,36,0)
+	workers.run(worker, this,
+	            jobs->len >= GREP_PARALLEL_MIN ? jobs->len : 1);
+#else
+	for (guint i = 0; i < jobs->len && !cancelled; i++) {
+		search(g_array_index(jobs, Job, i));
+
+		if (interface.is_interrupted())
+			cancelled = TRUE;
+	}
+#endif
+
+	if (cancelled)
+		throw Error("Interrupted");
+
+	for (guint i = 0; i < jobs->len; i++) {
+		Job &job = g_array_index(jobs, Job, i);
+
+		if (job.skipped)
+			throw Error("File \"%s\" is too large to be searched "
+			            "for pattern match constructs", job.filename);
+	}
+}
+
+/**
+ * Get the results of all files in the order
+ * they have been added.
+ *
+ * @return Results or NULL if nothing has been found.
+ *         Must be freed with g_string_free().
+ */
+GString *
+Grep::get_results(void)
+{
+	GString *results = NULL;
+
+	for (guint i = 0; i < jobs->len; i++) {
+		Job &job = g_array_index(jobs, Job, i);
+
+		if (!job.results)
+			continue;
+
+		if (!results) {
+			/* take over the first file's results */
+			results = job.results;
+		} else {
+			g_string_append_len(results, job.results->str,
+			                    job.results->len);
+			g_string_free(job.results, TRUE);
+		}
+		job.results = NULL;
+	}
+
+	return results;
+}
+
+/*
+ * Command states
+ */
+
+/*$ FF grep
+ * FFq[glob]$[pattern]$ -- Search files without opening them
+ * :FFq[glob]$[pattern]$ -> Success|Failure
+ *
+ * Searches all regular files matching the glob pattern
+ * <glob> for the search <pattern> and sets the string
+ * part of Q-Register <q> to a list of all occurrences
+ * found.
+ * The register is created if it does not yet exist.
+ * Every occurrence is reported on its own line in the
+ * format \(lq\fIfilename\fP:\fIline\fP:\fIcolumn\fP\(rq,
+ * where <line> and <column> count from 1.
+ * <column> is the byte offset of the occurrence within its
+ * line, so this format is understood by many other tools.
+ * Files are reported in the order they have been globbed.
+ *
+ * The files are not opened as buffers, but are searched
+ * directly in the file system and possibly by several threads
+ * at once.
+ * This is much faster than opening every file with \fBEB\fP
+ * and searching it with \fBS\fP, especially for large projects.
+ * Note that files are searched as they are stored on disk, so
+ * modifications of files already opened in the buffer ring
+ * are not taken into account.
+ * Searching can be interrupted.
+ * Files larger than 2 GiB can only be searched for patterns
+ * without any match constructs.
+ * Searching such files for other patterns yields an error.
+ *
+ * <glob> is a glob pattern as accepted by \fBEN\fP.
+ * If it is empty, all files in the current directory are searched.
+ * <pattern> is a search pattern just like for \fBS\fP,
+ * including all pattern match constructs.
+ * It is saved in the search register \(lq_\(rq and may be
+ * omitted to use the pattern of the last search.
+ * The integer part of \(lq_\(rq is set to a success boolean
+ * signalling whether any occurrence has been found.
+ * If colon-modified, this boolean is also returned.
+ * Otherwise, an error message is displayed if nothing
+ * has been found, like with \fBS\fP.
+ *
+ * String-building characters are enabled for both
+ * string arguments and <glob> is considered a file name
+ * with regard to auto-completions.
+ */
+State *
+StateGrep::got_register(QRegister *reg)
+{
+	machine.reset();
+
+	BEGIN_EXEC(&States::grep_glob);
+	undo.push_var(register_argument) = reg;
+	return &States::grep_glob;
+}
+
+State *
+StateGrep_glob::got_file(const gchar *filename)
+{
+	BEGIN_EXEC(&States::grep_pattern);
+
+	g_free(undo.push_str(glob_argument));
+	glob_argument = g_strdup(*filename ? filename : "*");
+
+	return &States::grep_pattern;
+}
+
+State *
+StateGrep_pattern::done(const gchar *str)
+{
+	BEGIN_EXEC(&States::start);
+
+	QRegister *search_reg = QRegisters::globals["_"];
+
+	gchar *pattern;
+	SearchMatcher *matcher;
+	GString *results = NULL;
+
+	if (*str) {
+		search_reg->undo_set_string();
+		search_reg->set_string(str);
+	}
+
+	pattern = search_reg->get_string();
+	try {
+		matcher = new_matcher(pattern);
+	} catch (...) {
+		g_free(pattern);
+		throw;
+	}
+	g_free(pattern);
+
+	if (matcher) {
+		/* NOTE: Globbing may be interrupted */
+		try {
+			Grep grep(*matcher);
+			Globber globber(glob_argument, G_FILE_TEST_IS_REGULAR);
+			gchar *filename;
+
+			while ((filename = globber.next()))
+				grep.add_file(filename);
+
+			grep.run();
+			results = grep.get_results();
+		} catch (...) {
+			delete matcher;
+			throw;
+		}
+
+		delete matcher;
+	}
+
+	register_argument->undo_set_string();
+	if (results) {
+		register_argument->set_string(results->str, results->len);
+		g_string_free(results, TRUE);
+	} else {
+		register_argument->set_string(NULL);
+	}
+
+	search_reg->undo_set_integer();
+	search_reg->set_integer(TECO_BOOL(results));
+
+	if (eval_colon())
+		expressions.push(search_reg->get_integer());
+	else if (!results && !loop_stack.items() /* not in loop */)
+		interface.msg(InterfaceCurrent::MSG_ERROR, "Search string not found!");
+
+	return &States::start;
+}
+
+} /* namespace SciTECO */
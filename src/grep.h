@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2012-2017 Robin Haberkorn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GREP_H
+#define __GREP_H
+
+#include <glib.h>
+
+#include "sciteco.h"
+#include "memory.h"
+#include "parser.h"
+#include "qregisters.h"
+#include "search.h"
+
+namespace SciTECO {
+
+/**
+ * Search of files that are not loaded into the ring,
+ * possibly by several threads.
+ */
+class Grep : public Object {
+	struct Job {
+		gchar *filename;
+		/** Occurrences as `filename:line:column` lines or NULL */
+		GString *results;
+		/** Whether the file was too large to be searched */
+		bool skipped;
+	};
+
+	const SearchMatcher &matcher;
+
+	/** Array of Job */
+	GArray *jobs;
+	/** Next job to take (accessed atomically) */
+	gint next_job;
+	/** Whether searching has been interrupted (accessed atomically) */
+	gint cancelled;
+
+	void search(Job &job);
+#if GLIB_CHECK_VERSION(2,36,0)
+	static gpointer worker(gpointer data);
+#endif
+
+public:
+	Grep(const SearchMatcher &_matcher);
+	~Grep();
+
+	void add_file(gchar *filename);
+	void run(void);
+	GString *get_results(void);
+};
+
+/*
+ * Command states
+ */
+
+class StateGrep : public StateExpectQReg {
+public:
+	StateGrep() : StateExpectQReg(QREG_OPTIONAL_INIT) {}
+
+private:
+	State *got_register(QRegister *reg);
+};
+
+class StateGrep_glob : public StateExpectFile {
+public:
+	StateGrep_glob() : StateExpectFile(true, false) {}
+
+private:
+	State *got_file(const gchar *filename);
+};
+
+class StateGrep_pattern : public StateSearch {
+private:
+	void initial(void) {}
+	void process(const gchar *str, gint new_chars) {}
+	State *done(const gchar *str);
+};
+
+namespace States {
+	extern StateGrep		grep;
+	extern StateGrep_glob		grep_glob;
+	extern StateGrep_pattern	grep_pattern;
+}
+
+} /* namespace SciTECO */
+
+#endif
@@ -21,6 +21,7 @@
 
 #include <stdarg.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <glib.h>
 #include <glib/gprintf.h>
@@ -34,6 +35,119 @@
 
 namespace SciTECO {
 
+/**
+ * Minimum number of modifications per command line
+ * character before a document snapshot is considered.
+ */
+#define SNAPSHOT_MIN_MODIFICATIONS	1024
+/**
+ * Estimated memory cost in bytes of a single modification's
+ * undo token plus Scintilla's undo action.
+ */
+#define SNAPSHOT_MODIFICATION_COST	64
+
+template <class ViewImpl>
+ViewImpl *View<ViewImpl>::snapshot_view = NULL;
+template <class ViewImpl>
+ViewImpl *View<ViewImpl>::modification_view = NULL;
+template <class ViewImpl>
+guint View<ViewImpl>::modifications = 0;
+
+template <class ViewImpl>
+View<ViewImpl>::UndoTokenSnapshot::UndoTokenSnapshot(ViewImpl &_view)
+                                                    : view(_view)
+{
+	len = view.ssm(SCI_GETLENGTH);
+	text = (gchar *)g_malloc(len);
+	memcpy(text, (const gchar *)view.ssm(SCI_GETCHARACTERPOINTER), len);
+	/* the copy is not allocated via Object */
+	MemoryLimit::account(len);
+
+	anchor = view.ssm(SCI_GETANCHOR);
+	dot = view.ssm(SCI_GETCURRENTPOS);
+}
+
+template <class ViewImpl>
+void
+View<ViewImpl>::UndoTokenSnapshot::run(void)
+{
+	/*
+	 * The modifications after the snapshot have not
+	 * been collected by Scintilla, so restoring it must
+	 * not be collected either. Afterwards, the document
+	 * is in the state expected by Scintilla's undo history.
+	 */
+	view.ssm(SCI_SETUNDOCOLLECTION, FALSE);
+	view.ssm(SCI_CLEARALL);
+	view.ssm(SCI_APPENDTEXT, len, (sptr_t)text);
+	view.ssm(SCI_SETUNDOCOLLECTION, TRUE);
+
+	view.ssm(SCI_SETSEL, anchor, dot);
+}
+
+/**
+ * Push undo token for a modification of the view's
+ * current document that has already been performed.
+ *
+ * Usually, this is a SCI_UNDO token. But if a single
+ * command line character (e.g. a loop) modifies the
+ * document so often that the SCI_UNDO tokens and
+ * Scintilla's undo actions would take more memory than
+ * the document itself, a snapshot of the document is
+ * recorded instead and Scintilla's undo collection
+ * is suspended until end_snapshot() is called.
+ */
+template <class ViewImpl>
+void
+View<ViewImpl>::undo_modification(void)
+{
+	if (!undo.enabled)
+		return;
+	if (snapshot_view == &impl())
+		/* modification has not been collected */
+		return;
+
+	undo.push<UndoTokenMessage>(impl(), SCI_UNDO);
+
+	if (modification_view != &impl()) {
+		modification_view = &impl();
+		modifications = 0;
+	}
+	if (++modifications < SNAPSHOT_MIN_MODIFICATIONS ||
+	    (gsize)modifications*SNAPSHOT_MODIFICATION_COST <
+	    					(gsize)ssm(SCI_GETLENGTH))
+		return;
+
+	end_snapshot();
+	undo.push<UndoTokenSnapshot>(impl());
+	ssm(SCI_SETUNDOCOLLECTION, FALSE);
+	snapshot_view = &impl();
+}
+
+/**
+ * Resume Scintilla undo collection suspended by
+ * undo_modification().
+ *
+ * This must be called after every command line character
+ * and before the current document of a view is changed.
+ *
+ * @param view Only end the snapshot of this view.
+ *             If NULL, the snapshot of any view is ended.
+ */
+template <class ViewImpl>
+void
+View<ViewImpl>::end_snapshot(ViewImpl *view)
+{
+	if (snapshot_view && (!view || view == snapshot_view)) {
+		snapshot_view->ssm(SCI_SETUNDOCOLLECTION, TRUE);
+		snapshot_view = NULL;
+	}
+	if (!view || view == modification_view) {
+		modification_view = NULL;
+		modifications = 0;
+	}
+}
+
 template <class ViewImpl>
 void
 View<ViewImpl>::set_representations(void)
@@ -101,6 +101,36 @@ class View : public Object {
 		}
 	};
 
+	/**
+	 * Restores the entire document of a view.
+	 * Used instead of SCI_UNDO tokens when a single
+	 * command line character performs too many
+	 * modifications (see undo_modification()).
+	 */
+	class UndoTokenSnapshot : public UndoToken {
+		ViewImpl &view;
+
+		gchar *text;
+		gsize len;
+		sptr_t anchor, dot;
+
+	public:
+		UndoTokenSnapshot(ViewImpl &_view);
+		~UndoTokenSnapshot()
+		{
+			MemoryLimit::account(-(gssize)len);
+			g_free(text);
+		}
+
+		void run(void);
+	};
+
+	/** View with suspended Scintilla undo collection */
+	static ViewImpl *snapshot_view;
+	/** View and number of modifications in the current step */
+	static ViewImpl *modification_view;
+	static guint modifications;
+
 public:
 	/*
 	 * called after Interface initialization.
@@ -123,9 +153,22 @@ public:
 	undo_ssm(unsigned int iMessage,
 		 uptr_t wParam = 0, sptr_t lParam = 0)
 	{
+		if (G_UNLIKELY(iMessage == SCI_UNDO &&
+		               snapshot_view == &impl())) {
+			/*
+			 * The following modification must be collected.
+			 * This does not reset the modification counter,
+			 * which is already reset when the snapshot is taken.
+			 */
+			ssm(SCI_SETUNDOCOLLECTION, TRUE);
+			snapshot_view = NULL;
+		}
 		undo.push<UndoTokenMessage>(impl(), iMessage, wParam, lParam);
 	}
 
+	void undo_modification(void);
+	static void end_snapshot(ViewImpl *view = NULL);
+
 	void set_representations(void);
 	inline void
 	undo_set_representations(void)
@@ -251,6 +294,11 @@ public:
 	{
 		current_view->undo_ssm(iMessage, wParam, lParam);
 	}
+	inline void
+	undo_modification(void)
+	{
+		current_view->undo_modification();
+	}
 
 	/*
 	 * NOTE: could be rolled into a template, but
@@ -24,8 +24,14 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 
+#ifdef HAVE_LINUX_FS_H
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
 #include <glib.h>
 #include <glib/gprintf.h>
 #include <glib/gstdio.h>
@@ -87,26 +93,156 @@ set_file_attributes(const gchar *filename, FileAttributes attrs)
 #endif /* !G_OS_WIN32 */
 
 /**
- * Loads the view's document by reading all data from
- * a GIOChannel.
- * The EOL style is guessed from the channel's data
- * (if AUTOEOL is enabled).
- * This assumes that the channel is blocking.
- * Also it tries to guess the size of the file behind
- * channel in order to preallocate memory in Scintilla.
+ * Minimum size of files in bytes to load with
+ * a worker thread.
+ */
+#define LOAD_THREADED_MIN (32*1024*1024)
+/**
+ * Size of the blocks passed from the worker thread
+ * to Scintilla when loading files with a worker thread.
+ */
+#define LOAD_THREADED_BLOCK (4*1024*1024)
+
+/**
+ * Append all data of an EOLReader to the view's document.
  *
- * Any error reading the GIOChannel is propagated as
- * an exception.
+ * Loading can be interrupted.
+ */
+void
+IOView::append(EOLReader &reader)
+{
+	const gchar *data;
+	gsize data_len;
+
+	while ((data = reader.convert(data_len))) {
+		ssm(SCI_APPENDTEXT, data_len, (sptr_t)data);
+
+		if (interface.is_interrupted())
+			throw Error("Interrupted");
+	}
+}
+
+#if GLIB_CHECK_VERSION(2,36,0)
+
+struct LoaderBlock {
+	/** EOL-normalized data or NULL at the end */
+	const gchar *data;
+	gsize len;
+};
+
+struct LoaderContext {
+	EOLReader *reader;
+	/** Queue of LoaderBlock */
+	GAsyncQueue *blocks;
+	/** Whether loading has been cancelled (accessed atomically) */
+	gint cancelled;
+};
+
+static gpointer
+load_worker(gpointer data)
+{
+	LoaderContext *ctx = (LoaderContext *)data;
+	const gchar *block_data;
+
+	do {
+		LoaderBlock *block = g_new(LoaderBlock, 1);
+
+		block_data = g_atomic_int_get(&ctx->cancelled)
+			? NULL : ctx->reader->convert(block->len);
+		block->data = block_data;
+		g_async_queue_push(ctx->blocks, block);
+	} while (block_data);
+
+	return NULL;
+}
+
+/**
+ * Append all data of an EOLReader to the view's document,
+ * reading and EOL-normalizing it in a worker thread.
  *
- * @param channel Channel to read from.
+ * This way, reading (e.g. paging in a memory mapped file)
+ * and EOL translation of the next block overlap with
+ * appending the previous one to Scintilla.
+ * The blocks returned by the reader must stay valid
+ * while it converts following blocks and the reader
+ * must not throw exceptions, which is the case for
+ * EOLReaderMem.
+ *
+ * Loading can be interrupted.
  */
 void
-IOView::load(GIOChannel *channel)
+IOView::append_threaded(EOLReader &reader)
 {
-	GStatBuf stat_buf;
+	LoaderContext ctx;
+	GThread *thread;
+	LoaderBlock *block;
+	bool interrupted = false;
+
+	ctx.reader = &reader;
+	ctx.blocks = g_async_queue_new();
+	ctx.cancelled = FALSE;
+
+	thread = g_thread_try_new("load", load_worker, &ctx, NULL);
+	if (!thread) {
+		g_async_queue_unref(ctx.blocks);
+		append(reader);
+		return;
+	}
 
-	EOLReaderGIO reader(channel);
+	while ((block = (LoaderBlock *)g_async_queue_pop(ctx.blocks))->data) {
+		/*
+		 * After an interruption, the remaining blocks
+		 * are only drained.
+		 */
+		if (!interrupted) {
+			ssm(SCI_APPENDTEXT, block->len, (sptr_t)block->data);
+
+			if (interface.is_interrupted()) {
+				/* the worker stops after the current block */
+				g_atomic_int_set(&ctx.cancelled, TRUE);
+				interrupted = true;
+			}
+		}
 
+		g_free(block);
+	}
+	g_free(block);
+
+	g_thread_join(thread);
+	g_async_queue_unref(ctx.blocks);
+
+	if (interrupted)
+		throw Error("Interrupted");
+}
+
+#else /* !GLIB_CHECK_VERSION(2,36,0) */
+
+void
+IOView::append_threaded(EOLReader &reader)
+{
+	append(reader);
+}
+
+#endif
+
+/**
+ * Loads the view's document from an EOLReader.
+ * The EOL style is guessed from the data
+ * (if AUTOEOL is enabled).
+ *
+ * Any error reading the data is propagated as
+ * an exception.
+ *
+ * @param reader Reader to take data from.
+ * @param size Expected size of the data in bytes,
+ *             used to preallocate memory in Scintilla.
+ *             May be 0 if unknown.
+ * @param threaded Whether to read data with a worker thread
+ *                 (see append_threaded()).
+ */
+void
+IOView::load(EOLReader &reader, gsize size, bool threaded)
+{
 	ssm(SCI_BEGINUNDOACTION);
 	ssm(SCI_CLEARALL);
 
@@ -114,20 +250,15 @@ IOView::load(GIOChannel *channel)
 	 * Preallocate memory based on the file size.
 	 * May waste a few bytes if file contains DOS EOLs
 	 * and EOL translation is enabled, but is faster.
-	 * NOTE: g_io_channel_unix_get_fd() should report the correct fd
-	 * on Windows, too.
 	 */
-	stat_buf.st_size = 0;
-	if (!fstat(g_io_channel_unix_get_fd(channel), &stat_buf) &&
-	    stat_buf.st_size > 0)
-		ssm(SCI_ALLOCATE, stat_buf.st_size);
+	if (size > 0)
+		ssm(SCI_ALLOCATE, size);
 
 	try {
-		const gchar *data;
-		gsize data_len;
-
-		while ((data = reader.convert(data_len)))
-			ssm(SCI_APPENDTEXT, data_len, (sptr_t)data);
+		if (threaded)
+			append_threaded(reader);
+		else
+			append(reader);
 	} catch (...) {
 		ssm(SCI_ENDUNDOACTION);
 		throw; /* forward */
@@ -153,6 +284,91 @@ IOView::load(GIOChannel *channel)
 	ssm(SCI_ENDUNDOACTION);
 }
 
+/**
+ * Loads the view's document by reading all data from
+ * a GIOChannel.
+ * This assumes that the channel is blocking.
+ * Also it tries to guess the size of the file behind
+ * channel in order to preallocate memory in Scintilla.
+ *
+ * Any error reading the GIOChannel is propagated as
+ * an exception.
+ *
+ * @param channel Channel to read from.
+ */
+void
+IOView::load(GIOChannel *channel)
+{
+	GStatBuf stat_buf;
+
+	EOLReaderGIO reader(channel);
+
+	/*
+	 * NOTE: g_io_channel_unix_get_fd() should report the correct fd
+	 * on Windows, too.
+	 */
+	stat_buf.st_size = 0;
+	if (fstat(g_io_channel_unix_get_fd(channel), &stat_buf) ||
+	    stat_buf.st_size < 0)
+		stat_buf.st_size = 0;
+
+	load(reader, stat_buf.st_size);
+}
+
+/**
+ * Load view's document from a memory mapped file.
+ *
+ * Mapping the file saves copying it into an intermediate
+ * buffer and the EOL-normalized data can be passed to
+ * Scintilla in few large chunks.
+ * The mapping is private, so EOL translation may modify
+ * it without changing the file.
+ *
+ * @param filename File to load.
+ * @return false if the file cannot be mapped,
+ *         so it must be read conventionally.
+ */
+bool
+IOView::load_mapped(const gchar *filename)
+{
+	GStatBuf stat_buf;
+	GMappedFile *file;
+
+	/*
+	 * Only regular files can be mapped reliably.
+	 * Especially files in pseudo file systems often
+	 * report a size of 0 even though they have contents.
+	 */
+	if (g_stat(filename, &stat_buf) ||
+	    !S_ISREG(stat_buf.st_mode) || stat_buf.st_size <= 0)
+		return false;
+
+	file = g_mapped_file_new(filename, TRUE, NULL);
+	if (!file)
+		return false;
+
+	gsize length = g_mapped_file_get_length(file);
+	/*
+	 * Large files are converted in blocks by a worker
+	 * thread, so we do not have to wait for the entire
+	 * file to be paged in and converted.
+	 */
+	bool threaded = length >= LOAD_THREADED_MIN;
+
+	EOLReaderMem reader(g_mapped_file_get_contents(file), length,
+	                    threaded ? LOAD_THREADED_BLOCK : G_MAXSIZE);
+
+	try {
+		load(reader, length, threaded);
+	} catch (...) {
+		g_mapped_file_unref(file);
+		throw; /* forward */
+	}
+
+	g_mapped_file_unref(file);
+	return true;
+}
+
 /**
  * Load view's document from file.
  */
@@ -162,6 +378,13 @@ IOView::load(const gchar *filename)
 	GError *error = NULL;
 	GIOChannel *channel;
 
+	gint64 start_time = g_get_monotonic_time();
+	gdouble duration;
+	gsize length;
+
+	if (load_mapped(filename))
+		goto loaded;
+
 	channel = g_io_channel_new_file(filename, "r", &error);
 	if (!channel) {
 		Error err("Error opening file \"%s\" for reading: %s",
@@ -189,21 +412,203 @@ IOView::load(const gchar *filename)
 
 	/* also closes file: */
 	g_io_channel_unref(channel);
-}
 
-#if 0
+loaded:
+	/* enabled by G_MESSAGES_DEBUG */
+	duration = (gdouble)(g_get_monotonic_time() - start_time) /
+	           G_USEC_PER_SEC;
+	length = ssm(SCI_GETLENGTH);
+	g_debug("Loaded \"%s\": %" G_GSIZE_FORMAT " bytes in %.3fs "
+	        "(%.1f MiB/s)", filename, length, duration,
+	        duration > 0 ? length / duration / (1024*1024) : 0.);
+}
 
 /*
- * TODO: on UNIX it may be better to open() the current file, unlink() it
- * and keep the file descriptor in the UndoToken.
- * When the operation is undone, the file descriptor's contents are written to
- * the file (which should be efficient enough because it is written to the same
- * filesystem). This way we could avoid messing around with save point files.
+ * Save point files are named after the original file
+ * and kept in the same directory, so they can be recovered
+ * if SciTECO should crash.
+ */
+
+static gint savepoint_id = 0;
+
+static gchar *
+get_savepoint_filename(const gchar *filename)
+{
+	gchar *dirname, *basename, *savepoint;
+	gchar savepoint_basename[FILENAME_MAX];
+
+	basename = g_path_get_basename(filename);
+	g_snprintf(savepoint_basename, sizeof(savepoint_basename),
+		   ".teco-%d-%s~", savepoint_id, basename);
+	g_free(basename);
+	dirname = g_path_get_dirname(filename);
+	savepoint = g_build_filename(dirname, savepoint_basename, NIL);
+	g_free(dirname);
+
+	return savepoint;
+}
+
+#if defined(HAVE_LINUX_FS_H) && defined(FICLONE)
+
+/**
+ * Copy the entire contents of one file descriptor
+ * into another one.
+ */
+static bool
+copy_fd(int src, int dst)
+{
+	gchar *buffer;
+	gssize len = 0;
+
+	if (lseek(src, 0, SEEK_SET) < 0)
+		return false;
+
+	buffer = (gchar *)g_malloc(64*1024);
+
+	while ((len = read(src, buffer, 64*1024)) > 0) {
+		gssize written = 0;
+
+		while (written < len) {
+			gssize rc = write(dst, buffer + written, len - written);
+			if (rc < 0) {
+				g_free(buffer);
+				return false;
+			}
+			written += rc;
+		}
+	}
+
+	g_free(buffer);
+	return len == 0;
+}
+
+/**
+ * Save point file created as a reflink (copy-on-write
+ * clone) of the original file.
+ *
+ * Creating it does not copy any data and the original
+ * file can be overwritten in place, preserving its owner,
+ * permissions and hard links.
+ * When undoing, the file's contents are replaced with the
+ * clone's, again without copying if possible.
+ */
+class UndoTokenRestoreClone : public UndoToken {
+	gchar *savepoint;
+	gchar *filename;
+
+public:
+	UndoTokenRestoreClone(gchar *_savepoint, const gchar *_filename)
+			     : savepoint(_savepoint), filename(g_strdup(_filename)) {}
+
+	~UndoTokenRestoreClone()
+	{
+		if (savepoint) {
+			g_unlink(savepoint);
+			g_free(savepoint);
+		}
+		g_free(filename);
+
+		savepoint_id--;
+	}
+
+	void
+	run(void)
+	{
+		int src, dst = -1;
+		bool restored = false;
+
+		src = g_open(savepoint, O_RDONLY, 0);
+		if (src >= 0)
+			dst = g_open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if (dst >= 0)
+			restored = !ioctl(dst, FICLONE, src) || copy_fd(src, dst);
+
+		if (dst >= 0 && close(dst))
+			restored = false;
+		if (src >= 0)
+			close(src);
+
+		if (!restored) {
+			/* keep the save point file, so it can be recovered */
+			interface.msg(InterfaceCurrent::MSG_WARNING,
+				      "Unable to restore save point file \"%s\"",
+				      savepoint);
+			g_free(savepoint);
+			savepoint = NULL;
+		}
+	}
+};
+
+/**
+ * Try to create a save point file by cloning the file.
+ *
+ * This requires a file system supporting
+ * reflinks (e.g. Btrfs or XFS).
+ * Since the save point file is complete before the
+ * original file is touched, the old contents can always
+ * be recovered, even if writing the new contents fails.
+ *
+ * @param filename File to save point.
+ * @return true if the save point has been created and
+ *         the file may be overwritten in place.
  */
+static bool
+make_savepoint_clone(const gchar *filename)
+{
+	gchar *savepoint;
+	int orig, fd;
+	bool cloned;
+
+	orig = g_open(filename, O_RDONLY, 0);
+	if (orig < 0)
+		return false;
+
+	savepoint = get_savepoint_filename(filename);
+	fd = g_open(savepoint, O_WRONLY | O_CREAT | O_EXCL, 0600);
+	if (fd < 0) {
+		close(orig);
+		g_free(savepoint);
+		return false;
+	}
+
+	/*
+	 * The clone must reach the disk before the original
+	 * is truncated.
+	 */
+	cloned = !ioctl(fd, FICLONE, orig) && !fsync(fd);
+	close(orig);
+	if (close(fd))
+		cloned = false;
+
+	if (!cloned) {
+		g_unlink(savepoint);
+		g_free(savepoint);
+		return false;
+	}
+	savepoint_id++;
+
+	/*
+	 * NOTE: passes ownership of savepoint string to undo token.
+	 */
+	undo.push_own<UndoTokenRestoreClone>(savepoint, filename);
+	return true;
+}
 
 #else
 
-static gint savepoint_id = 0;
+static inline bool
+make_savepoint_clone(const gchar *filename)
+{
+	return false;
+}
+
+#endif
+
+/*
+ * If the file system does not support cloning,
+ * the original file is renamed to the save point file,
+ * so writing the new file does not require copying it.
+ */
 
 class UndoTokenRestoreSavePoint : public UndoToken {
 	gchar	*savepoint;
@@ -258,16 +663,7 @@ public:
 static void
 make_savepoint(const gchar *filename)
 {
-	gchar *dirname, *basename, *savepoint;
-	gchar savepoint_basename[FILENAME_MAX];
-
-	basename = g_path_get_basename(filename);
-	g_snprintf(savepoint_basename, sizeof(savepoint_basename),
-		   ".teco-%d-%s~", savepoint_id, basename);
-	g_free(basename);
-	dirname = g_path_get_dirname(filename);
-	savepoint = g_build_filename(dirname, savepoint_basename, NIL);
-	g_free(dirname);
+	gchar *savepoint = get_savepoint_filename(filename);
 
 	if (g_rename(filename, savepoint)) {
 		interface.msg(InterfaceCurrent::MSG_WARNING,
@@ -284,12 +680,23 @@ make_savepoint(const gchar *filename)
 	undo.push_own<UndoTokenRestoreSavePoint>(savepoint, filename);
 }
 
-#endif
-
 void
 IOView::save(GIOChannel *channel)
 {
+#ifdef HAVE_WRITEV
+	/*
+	 * Write the document directly from Scintilla's
+	 * memory, bypassing the channel's buffer.
+	 */
+	EOLWriterFd writer(g_io_channel_unix_get_fd(channel),
+	                   ssm(SCI_GETEOLMODE));
+	GError *error = NULL;
+
+	if (g_io_channel_flush(channel, &error) == G_IO_STATUS_ERROR)
+		throw GlibError(error);
+#else
 	EOLWriterGIO writer(channel, ssm(SCI_GETEOLMODE));
+#endif
 	sptr_t gap;
 	gsize size;
 	const gchar *buffer;
@@ -310,6 +717,10 @@ IOView::save(GIOChannel *channel)
 		bytes_written = writer.convert(buffer, size);
 		g_assert(bytes_written == size);
 	}
+
+#ifdef HAVE_WRITEV
+	writer.flush();
+#endif
 }
 
 void
@@ -327,11 +738,17 @@ IOView::save(const gchar *filename)
 
 	if (undo.enabled) {
 		if (g_file_test(filename, G_FILE_TEST_IS_REGULAR)) {
+			/*
+			 * When cloning, the file is overwritten in
+			 * place, so its attributes are preserved anyway.
+			 */
+			if (!make_savepoint_clone(filename)) {
 #if defined(G_OS_UNIX) || defined(G_OS_HAIKU)
-			g_stat(filename, &file_stat);
+				g_stat(filename, &file_stat);
 #endif
-			attributes = get_file_attributes(filename);
-			make_savepoint(filename);
+				attributes = get_file_attributes(filename);
+				make_savepoint(filename);
+			}
 		} else {
 			undo.push<UndoTokenRemoveFile>(filename);
 		}
@@ -364,6 +781,8 @@ IOView::save(const gchar *filename)
 	/*
 	 * only a good try to inherit owner since process user must have
 	 * CHOWN capability traditionally reserved to root only.
+	 * This is not necessary for cloned save points,
+	 * where the file is overwritten in place.
 	 * FIXME: We should probably fall back to another save point
 	 * strategy.
 	 */
@@ -27,6 +27,7 @@
 #include "sciteco.h"
 #include "interface.h"
 #include "undo.h"
+#include "eol.h"
 
 namespace SciTECO {
 
@@ -117,6 +118,11 @@ class IOView : public ViewCurrent {
 		}
 	};
 
+	void append(EOLReader &reader);
+	void append_threaded(EOLReader &reader);
+	void load(EOLReader &reader, gsize size, bool threaded = false);
+	bool load_mapped(const gchar *filename);
+
 public:
 	void load(GIOChannel *channel);
 	void load(const gchar *filename);
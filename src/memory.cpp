@@ -184,6 +184,12 @@ MemoryLimit::get_usage(void)
 	return info.WorkingSetSize;
 }
 
+void
+MemoryLimit::account(gssize size)
+{
+	/* the working set includes all allocations */
+}
+
 #else
 /*
  * Portable fallback-implementation relying on C++11 sized allocators.
@@ -212,6 +218,19 @@ MemoryLimit::get_usage(void)
 	return memory_usage;
 }
 
+/**
+ * Account for memory that is not allocated
+ * via the C++ allocators (e.g. mapped memory).
+ *
+ * @param size Number of bytes allocated (positive)
+ *             or released (negative).
+ */
+void
+MemoryLimit::account(gssize size)
+{
+	memory_usage += size;
+}
+
 #endif /* MEMORY_USAGE_FALLBACK */
 
 void
@@ -239,6 +258,13 @@ void
 MemoryLimit::check(void)
 {
 	if (G_UNLIKELY(limit && get_usage() > limit)) {
+		/*
+		 * Try to get below the limit by moving
+		 * old undo tokens out of memory.
+		 */
+		if (undo.spill() && get_usage() <= limit)
+			return;
+
 		gchar *limit_str = g_format_size(limit);
 
 		Error err("Memory limit (%s) exceeded. See <EJ> command.",
@@ -79,6 +79,7 @@ public:
 	MemoryLimit() : limit(MEMORY_LIMIT_DEFAULT) {}
 
 	static gsize get_usage(void);
+	static void account(gssize size);
 
 	void set_limit(gsize new_limit = 0);
 
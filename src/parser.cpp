@@ -40,6 +40,7 @@
 #include "search.h"
 #include "spawn.h"
 #include "glob.h"
+#include "grep.h"
 #include "help.h"
 #include "cmdline.h"
 #include "ioview.h"
@@ -84,6 +85,50 @@ static gint nest_level = 0;
 gchar *strings[2] = {NULL, NULL};
 gchar escape_char = CTL_KEY_ESC;
 
+namespace StringArgument {
+	/** Length of strings[0] */
+	static gsize len = 0;
+	/** Allocated size of strings[0] */
+	static gsize size = 0;
+
+	class UndoTokenTruncate : public UndoToken {
+		gsize len;
+
+	public:
+		UndoTokenTruncate(gsize _len) : len(_len) {}
+
+		void
+		run(void)
+		{
+			strings[0][len] = '\0';
+			StringArgument::len = len;
+		}
+	};
+
+	class UndoTokenRestore : public UndoToken {
+		gchar *str;
+		gsize len;
+
+	public:
+		UndoTokenRestore(const gchar *_str, gsize _len)
+		                : str(g_strndup(_str, _len)), len(_len) {}
+		~UndoTokenRestore()
+		{
+			g_free(str);
+		}
+
+		void
+		run(void)
+		{
+			g_free(strings[0]);
+			strings[0] = str;
+			str = NULL;
+			StringArgument::len = len;
+			StringArgument::size = len+1;
+		}
+	};
+}
+
 LoopStack loop_stack;
 
 /**
@@ -96,6 +141,554 @@ LoopStack loop_stack;
  */
 static guint loop_stack_fp = 0;
 
+/**
+ * Append to the string argument.
+ *
+ * @param str String to append (not necessarily null-terminated).
+ * @param str_len Length of \a str.
+ */
+void
+StringArgument::append(const gchar *str, gsize str_len)
+{
+	if (!strings[0]) {
+		len = size = 0;
+		/* only frees the buffer on rubout */
+		undo.push_str(strings[0]);
+	} else {
+		undo.push<UndoTokenTruncate>(len);
+	}
+
+	if (len + str_len + 1 > size) {
+		size = MAX(size*2, len + str_len + 1);
+		strings[0] = (gchar *)g_realloc(strings[0], size);
+	}
+
+	memcpy(strings[0] + len, str, str_len);
+	len += str_len;
+	strings[0][len] = '\0';
+}
+
+/**
+ * Take the string argument, resetting strings[0].
+ *
+ * The string is restored on rubout.
+ *
+ * @returns The string argument or NULL if it is empty.
+ *          It must be freed with g_free().
+ */
+gchar *
+StringArgument::take(void)
+{
+	gchar *str = strings[0];
+
+	if (str)
+		undo.push<UndoTokenRestore>(str, len);
+	else
+		undo.push_str(strings[0]);
+	strings[0] = NULL;
+
+	return str;
+}
+
+/**
+ * Parse-only skip recorded in a CachedMacro.
+ */
+class CachedMacro::Skip : public Object {
+	struct Label {
+		gchar *name;
+		gint pc;
+	};
+
+public:
+	Skip *next;
+
+	/** Program counter at the beginning of the skip */
+	gint pc;
+
+	/*
+	 * Parser state at the beginning of the skip.
+	 * The skip can only be replayed with the same state.
+	 */
+	Mode mode;
+	gint nest_level;
+	bool skip_else;
+	bool at;
+	gchar *skip_label;
+
+	/** Program counter after the end of the skip */
+	gint end_pc;
+
+	/*
+	 * Parser state at the end of the skip
+	 * (the mode will always be MODE_NORMAL
+	 * and no label is skipped to).
+	 */
+	gint end_nest_level;
+	bool end_skip_else;
+	bool end_at;
+
+	/** Labels defined in the skipped code */
+	GArray *labels;
+
+	Skip(gint _pc)
+	    : next(NULL), pc(_pc),
+	      mode(SciTECO::mode), nest_level(SciTECO::nest_level),
+	      skip_else(SciTECO::skip_else), at(Modifiers::at),
+	      skip_label(g_strdup(Goto::skip_label)),
+	      end_pc(-1), end_nest_level(0),
+	      end_skip_else(false), end_at(false),
+	      labels(g_array_new(FALSE, FALSE, sizeof(Label))) {}
+	/** Construct empty skip, e.g. to be loaded */
+	Skip()
+	    : next(NULL), pc(0), mode(MODE_NORMAL), nest_level(0),
+	      skip_else(false), at(false), skip_label(NULL),
+	      end_pc(0), end_nest_level(0),
+	      end_skip_else(false), end_at(false),
+	      labels(g_array_new(FALSE, FALSE, sizeof(Label))) {}
+
+	~Skip()
+	{
+		for (guint i = 0; i < labels->len; i++)
+			g_free(g_array_index(labels, Label, i).name);
+		g_array_free(labels, TRUE);
+		g_free(skip_label);
+	}
+
+	/**
+	 * Whether the skip can be replayed in the current
+	 * parser state.
+	 * Skips are only recorded in the start state,
+	 * so they must not be replayed in the middle of a command.
+	 */
+	inline bool
+	matches(void) const
+	{
+		return States::current == &States::start &&
+		       mode == SciTECO::mode &&
+		       nest_level == SciTECO::nest_level &&
+		       skip_else == SciTECO::skip_else &&
+		       at == Modifiers::at &&
+		       !g_strcmp0(skip_label, Goto::skip_label);
+	}
+
+	inline void
+	add_label(const gchar *name, gint label_pc)
+	{
+		Label label = {g_strdup(name), label_pc};
+		g_array_append_val(labels, label);
+	}
+
+	void replay(void);
+
+	void save(GString *buf) const;
+	static Skip *load(const gchar *&p, const gchar *end, gint code_len);
+
+	static void
+	destroy_list(gpointer data)
+	{
+		Skip *next;
+
+		for (Skip *skip = (Skip *)data; skip; skip = next) {
+			next = skip->next;
+			delete skip;
+		}
+	}
+};
+
+CachedMacro::Skip *CachedMacro::recording = NULL;
+
+/**
+ * Restore the parser state at the end of the
+ * skip, as if the skipped code had been parsed.
+ */
+void
+CachedMacro::Skip::replay(void)
+{
+	for (guint i = 0; i < labels->len; i++) {
+		Label &label = g_array_index(labels, Label, i);
+
+		Goto::table->undo_set(label.name,
+		                      Goto::table->set(label.name, label.pc));
+	}
+
+	if (Goto::skip_label) {
+		g_free(undo.push_str(Goto::skip_label));
+		Goto::skip_label = NULL;
+	}
+
+	if (SciTECO::nest_level != end_nest_level)
+		undo.push_var(SciTECO::nest_level) = end_nest_level;
+	if (SciTECO::skip_else != end_skip_else)
+		undo.push_var(SciTECO::skip_else) = end_skip_else;
+	if (Modifiers::at != end_at)
+		undo.push_var(Modifiers::at) = end_at;
+
+	undo.push_var(SciTECO::mode) = MODE_NORMAL;
+	macro_pc = end_pc;
+}
+
+/*
+ * Skip index files store all integers as 32-bit
+ * integers in native byte order, since the cache is local
+ * to the machine.
+ * Strings are stored with their length (-1 for NULL)
+ * followed by the string's characters.
+ */
+
+static inline void
+write_int(GString *buf, gint32 value)
+{
+	g_string_append_len(buf, (const gchar *)&value, sizeof(value));
+}
+
+static void
+write_str(GString *buf, const gchar *str)
+{
+	if (!str) {
+		write_int(buf, -1);
+		return;
+	}
+
+	write_int(buf, strlen(str));
+	g_string_append(buf, str);
+}
+
+static inline bool
+read_int(const gchar *&p, const gchar *end, gint32 &value)
+{
+	if (end - p < (gssize)sizeof(value))
+		return false;
+	memcpy(&value, p, sizeof(value));
+	p += sizeof(value);
+	return true;
+}
+
+static bool
+read_str(const gchar *&p, const gchar *end, gchar *&str)
+{
+	gint32 len;
+
+	str = NULL;
+	if (!read_int(p, end, len) || len < -1 || end - p < len)
+		return false;
+	if (len >= 0) {
+		str = g_strndup(p, len);
+		p += len;
+	}
+	return true;
+}
+
+/**
+ * Append skip to a skip index buffer.
+ */
+void
+CachedMacro::Skip::save(GString *buf) const
+{
+	write_int(buf, pc);
+	write_int(buf, mode);
+	write_int(buf, nest_level);
+	write_int(buf, skip_else | at << 1 |
+	               end_skip_else << 2 | end_at << 3);
+	write_str(buf, skip_label);
+	write_int(buf, end_pc);
+	write_int(buf, end_nest_level);
+
+	write_int(buf, labels->len);
+	for (guint i = 0; i < labels->len; i++) {
+		Label &label = g_array_index(labels, Label, i);
+
+		write_str(buf, label.name);
+		write_int(buf, label.pc);
+	}
+}
+
+/**
+ * Read a skip from a skip index buffer.
+ *
+ * @param p Pointer into the buffer, advanced
+ *          behind the skip.
+ * @param end End of the buffer.
+ * @param code_len Length of the macro the skip is
+ *                 loaded for.
+ * @returns New skip or NULL if the buffer is invalid.
+ */
+CachedMacro::Skip *
+CachedMacro::Skip::load(const gchar *&p, const gchar *end, gint code_len)
+{
+	Skip *skip = new Skip;
+	gint32 value, flags, labels_len;
+
+	if (!read_int(p, end, value) || value < 0 || value > code_len)
+		goto error;
+	skip->pc = value;
+	if (!read_int(p, end, value) ||
+	    value <= MODE_NORMAL || value > MODE_PARSE_ONLY_COND)
+		goto error;
+	skip->mode = (Mode)value;
+	if (!read_int(p, end, value) || value < 0)
+		goto error;
+	skip->nest_level = value;
+	if (!read_int(p, end, flags))
+		goto error;
+	skip->skip_else = flags & 1;
+	skip->at = flags & 2;
+	skip->end_skip_else = flags & 4;
+	skip->end_at = flags & 8;
+	if (!read_str(p, end, skip->skip_label))
+		goto error;
+	if (!read_int(p, end, value) || value < skip->pc || value > code_len)
+		goto error;
+	skip->end_pc = value;
+	if (!read_int(p, end, value) || value < 0)
+		goto error;
+	skip->end_nest_level = value;
+
+	if (!read_int(p, end, labels_len) || labels_len < 0)
+		goto error;
+	for (gint i = 0; i < labels_len; i++) {
+		Label label;
+
+		if (!read_str(p, end, label.name))
+			goto error;
+		if (!label.name || !read_int(p, end, value) ||
+		    value < 0 || value > code_len) {
+			g_free(label.name);
+			goto error;
+		}
+		label.pc = value;
+		g_array_append_val(skip->labels, label);
+	}
+
+	return skip;
+
+error:
+	delete skip;
+	return NULL;
+}
+
+CachedMacro::~CachedMacro()
+{
+	if (skips)
+		g_hash_table_destroy(skips);
+	g_free(code);
+}
+
+/**
+ * Replay a skip previously recorded at a program counter.
+ *
+ * This must be called when the parser has just entered
+ * a parse-only mode.
+ *
+ * @param pc Program counter after the command that
+ *           started the skip.
+ * @returns Whether a matching skip has been replayed.
+ *          In this case, macro_pc is set to the end
+ *          of the skip.
+ */
+bool
+CachedMacro::replay_skip(gint pc)
+{
+	if (!skips)
+		return false;
+
+	for (Skip *skip = (Skip *)g_hash_table_lookup(skips, GINT_TO_POINTER(pc));
+	     skip; skip = skip->next) {
+		if (skip->matches()) {
+			skip->replay();
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/**
+ * Start recording a skip.
+ *
+ * @param pc Program counter after the command that
+ *           started the skip.
+ */
+void
+CachedMacro::begin_skip(gint pc)
+{
+	cancel_skip();
+
+	/*
+	 * Skips usually start in the start state, but
+	 * the state machine could also be in the middle of
+	 * a command, e.g. after a macro that terminated in
+	 * parse-only mode.
+	 */
+	if (States::current == &States::start)
+		recording = new Skip(pc);
+}
+
+/**
+ * Finish recording a skip and add it to the index.
+ *
+ * @param pc Program counter after the command that
+ *           ended the skip.
+ */
+void
+CachedMacro::end_skip(gint pc)
+{
+	Skip *skip = recording;
+
+	if (!skip)
+		return;
+	recording = NULL;
+
+	if (States::current != &States::start) {
+		delete skip;
+		return;
+	}
+
+	skip->end_pc = pc;
+	skip->end_nest_level = nest_level;
+	skip->end_skip_else = skip_else;
+	skip->end_at = Modifiers::at;
+
+	add_skip(skip);
+	skips_modified = true;
+}
+
+/**
+ * Add a skip to the index.
+ */
+void
+CachedMacro::add_skip(Skip *skip)
+{
+	if (!skips)
+		skips = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+		                              NULL, Skip::destroy_list);
+
+	skip->next = (Skip *)g_hash_table_lookup(skips, GINT_TO_POINTER(skip->pc));
+	/* does not free the old list since it is the new list's tail */
+	g_hash_table_steal(skips, GINT_TO_POINTER(skip->pc));
+	g_hash_table_insert(skips, GINT_TO_POINTER(skip->pc), skip);
+}
+
+/**
+ * Load the skip index from a file.
+ *
+ * The file must have been written by save_skips()
+ * for the same macro code.
+ * Invalid files are ignored.
+ *
+ * @param filename Skip index file name.
+ * @param key Null-terminated key identifying the macro code
+ *            and the SciTECO version.
+ *            It must match the key the file was saved with.
+ * @returns Whether the index could be loaded.
+ */
+bool
+CachedMacro::load_skips(const gchar *filename, const gchar *key)
+{
+	gchar *contents;
+	gsize size;
+	const gchar *p, *end;
+	gint code_len = strlen(code);
+	gsize key_len = strlen(key)+1;
+	GHashTable *loaded;
+
+	if (!g_file_get_contents(filename, &contents, &size, NULL))
+		return false;
+	if (size < key_len || memcmp(contents, key, key_len)) {
+		g_free(contents);
+		return false;
+	}
+
+	/*
+	 * The current index is only replaced when the
+	 * entire file is valid.
+	 */
+	loaded = skips;
+	skips = NULL;
+
+	p = contents + key_len;
+	end = contents + size;
+	while (p < end) {
+		Skip *skip = Skip::load(p, end, code_len);
+
+		if (!skip) {
+			if (skips)
+				g_hash_table_destroy(skips);
+			skips = loaded;
+			g_free(contents);
+			return false;
+		}
+
+		add_skip(skip);
+	}
+
+	if (loaded)
+		g_hash_table_destroy(loaded);
+	skips_modified = false;
+	g_free(contents);
+	return true;
+}
+
+/**
+ * Save the skip index to a file if skips have been
+ * recorded since it was loaded.
+ *
+ * The file is replaced atomically, so concurrent
+ * SciTECO processes will never load incomplete indices.
+ * Errors are ignored since the index is only a cache.
+ *
+ * @param filename Skip index file name.
+ *                 Its directory is created if necessary.
+ * @param key Null-terminated key identifying the macro code.
+ *            See load_skips().
+ */
+void
+CachedMacro::save_skips(const gchar *filename, const gchar *key)
+{
+	GString *buf;
+	GHashTableIter iter;
+	gpointer value;
+	gchar *dirname;
+
+	if (!skips_modified)
+		return;
+	skips_modified = false;
+
+	dirname = g_path_get_dirname(filename);
+	g_mkdir_with_parents(dirname, 0700);
+	g_free(dirname);
+
+	buf = g_string_new_len(key, strlen(key)+1);
+
+	g_hash_table_iter_init(&iter, skips);
+	while (g_hash_table_iter_next(&iter, NULL, &value))
+		for (Skip *skip = (Skip *)value; skip; skip = skip->next)
+			skip->save(buf);
+
+	g_file_set_contents(filename, buf->str, buf->len, NULL);
+	g_string_free(buf, TRUE);
+}
+
+/**
+ * Record a label defined while skipping.
+ * This does nothing if no skip is being recorded.
+ */
+void
+CachedMacro::record_label(const gchar *name, gint pc)
+{
+	if (recording)
+		recording->add_label(name, pc);
+}
+
+/**
+ * Discard the skip currently being recorded (if any).
+ */
+void
+CachedMacro::cancel_skip(void)
+{
+	delete recording;
+	recording = NULL;
+}
+
 /**
  * Handles all expected exceptions, converting them to
  * SciTECO::Error and preparing them for stack frame insertion.
@@ -103,7 +696,7 @@ static guint loop_stack_fp = 0;
  * SciTECO::Cmdline *.
  */
 void
-Execute::step(const gchar *macro, gint stop_pos)
+Execute::step(const gchar *macro, gint stop_pos, CachedMacro *cached)
 {
 	try {
 		/*
@@ -126,8 +719,20 @@ Execute::step(const gchar *macro, gint stop_pos)
 
 				memlimit.check();
 
+				Mode prev_mode = mode;
+
 				State::input(macro[macro_pc]);
 				macro_pc++;
+
+				if (G_UNLIKELY(cached && mode != prev_mode)) {
+					if (prev_mode == MODE_NORMAL) {
+						/* entered parse-only mode */
+						if (!cached->replay_skip(macro_pc))
+							cached->begin_skip(macro_pc);
+					} else if (mode == MODE_NORMAL) {
+						cached->end_skip(macro_pc);
+					}
+				}
 			}
 
 			/*
@@ -149,12 +754,21 @@ Execute::step(const gchar *macro, gint stop_pos)
 	}
 }
 
-/*
- * may throw non SciTECO::Error exceptions which are not to be
- * associated with the macro invocation stack frame
+/**
+ * Execute a macro in a new macro invocation frame.
+ *
+ * This may throw non SciTECO::Error exceptions which are not
+ * to be associated with the macro invocation stack frame.
+ *
+ * @param macro The null-terminated macro code.
+ * @param locals Whether to create a new local
+ *               Q-Register table.
+ * @param cached Cached macro that \a macro belongs to
+ *               or NULL.
+ *               It is used to speed up parse-only skips.
  */
 void
-Execute::macro(const gchar *macro, bool locals)
+Execute::macro(const gchar *macro, bool locals, CachedMacro *cached)
 {
 	GotoTable *parent_goto_table = Goto::table;
 	GotoTable macro_goto_table(false);
@@ -205,7 +819,9 @@ Execute::macro(const gchar *macro, bool locals)
 
 	try {
 		try {
-			step(macro, strlen(macro));
+			step(macro, strlen(macro), cached);
+			/* the macro may have terminated while skipping */
+			CachedMacro::cancel_skip();
 		} catch (Return &info) {
 			/*
 			 * Macro returned - handle like regular
@@ -265,6 +881,8 @@ Execute::macro(const gchar *macro, bool locals)
 			throw; /* forward */
 		}
 	} catch (...) {
+		CachedMacro::cancel_skip();
+
 		g_free(Goto::skip_label);
 		Goto::skip_label = NULL;
 
@@ -286,43 +904,139 @@ Execute::macro(const gchar *macro, bool locals)
 	States::current = parent_state;
 }
 
+/**
+ * Get the key identifying a macro file in the skip index cache.
+ *
+ * It consists of the SciTECO version and the file's name,
+ * size and modification time.
+ * Skip indices are only valid for the same version, since
+ * they depend on how the parser works.
+ *
+ * @param filename Absolute file name.
+ * @param info The file's attributes.
+ * @returns Newly allocated key.
+ */
+static inline gchar *
+get_skip_cache_key(const gchar *filename, const GStatBuf &info)
+{
+	return g_strdup_printf(PACKAGE_STRING "\n%s\n"
+	                       "%" G_GINT64_FORMAT "\n%" G_GINT64_FORMAT "\n",
+	                       filename, (gint64)info.st_size,
+	                       (gint64)info.st_mtime);
+}
+
+/**
+ * Get the skip index cache file name of a macro file.
+ *
+ * @param filename Absolute file name.
+ * @returns Newly allocated file name in the user's
+ *          cache directory.
+ */
+static gchar *
+get_skip_cache_filename(const gchar *filename)
+{
+	gchar *checksum = g_compute_checksum_for_string(G_CHECKSUM_SHA1,
+	                                                filename, -1);
+	gchar *basename = g_strconcat(checksum, ".tesc", NIL);
+	gchar *ret = g_build_filename(g_get_user_cache_dir(), PACKAGE,
+	                              basename, NIL);
+
+	g_free(basename);
+	g_free(checksum);
+	return ret;
+}
+
+/**
+ * Execute a macro file.
+ *
+ * The skip index of macro files (see CachedMacro) is kept
+ * in the user's cache directory (e.g. ~/.cache/sciteco/), so
+ * it is reused by subsequent SciTECO processes.
+ * Cache files are identified by the macro file's absolute
+ * name, size and modification time.
+ *
+ * @param filename The macro file's name.
+ * @param locals Whether to create a new local
+ *               Q-Register table.
+ */
 void
 Execute::file(const gchar *filename, bool locals)
 {
 	GError *gerror = NULL;
-	gchar *macro_str, *p;
+	gchar *macro_str;
+	gsize macro_len;
+	CachedMacro *cached;
+	gsize hashbang_len = 0;
+
+	gchar *absolute;
+	GStatBuf info;
+	gchar *cache_filename = NULL, *cache_key = NULL;
+
+	absolute = get_absolute_path(filename);
+	if (!absolute || g_stat(absolute, &info)) {
+		g_free(absolute);
+		absolute = NULL;
+	}
 
-	if (!g_file_get_contents(filename, &macro_str, NULL, &gerror))
+	if (!g_file_get_contents(filename, &macro_str, &macro_len, &gerror)) {
+		g_free(absolute);
 		throw GlibError(gerror);
+	}
+	/* the skip index is used even if the file is executed only once */
+	cached = new CachedMacro(macro_str);
+
+	/*
+	 * Files modified in the second they are read
+	 * could be modified again without changing their
+	 * modification time, so their skips are not cached.
+	 * The size check catches files modified after g_stat().
+	 */
+	if (absolute && (goffset)info.st_size == (goffset)macro_len &&
+	    info.st_mtime < g_get_real_time()/G_USEC_PER_SEC) {
+		cache_filename = get_skip_cache_filename(absolute);
+		cache_key = get_skip_cache_key(absolute, info);
+		cached->load_skips(cache_filename, cache_key);
+	}
+	g_free(absolute);
 
 	/* only when executing files, ignore Hash-Bang line */
 	if (*macro_str == '#') {
-		p = strpbrk(macro_str, "\r\n");
+		gchar *p = strpbrk(macro_str, "\r\n");
 		if (G_UNLIKELY(!p))
 			/* empty script */
 			goto cleanup;
-		p++;
-	} else {
-		p = macro_str;
+		hashbang_len = p - macro_str + 1;
 	}
 
 	try {
-		macro(p, locals);
+		macro(macro_str + hashbang_len, locals, cached);
 	} catch (Error &error) {
-		error.pos += p - macro_str;
-		if (*macro_str == '#')
+		error.pos += hashbang_len;
+		if (hashbang_len)
 			error.line++;
 		error.add_frame(new Error::FileFrame(filename));
 
-		g_free(macro_str);
+		/* skips recorded before the error are still valid */
+		if (cache_filename)
+			cached->save_skips(cache_filename, cache_key);
+		g_free(cache_key);
+		g_free(cache_filename);
+		cached->unref();
 		throw; /* forward */
 	} catch (...) {
-		g_free(macro_str);
+		g_free(cache_key);
+		g_free(cache_filename);
+		cached->unref();
 		throw; /* forward */
 	}
 
+	if (cache_filename)
+		cached->save_skips(cache_filename, cache_key);
+
 cleanup:
-	g_free(macro_str);
+	g_free(cache_key);
+	g_free(cache_filename);
+	cached->unref();
 }
 
 State::State()
@@ -582,9 +1296,8 @@ StateExpectString::custom(gchar chr)
 
 	if (!nesting) {
 		State *next;
-		gchar *string = strings[0];
+		gchar *string = StringArgument::take();
 
-		undo.push_str(strings[0]) = NULL;
 		if (last)
 			undo.push_var(escape_char) = CTL_KEY_ESC;
 		nesting = 1;
@@ -632,14 +1345,14 @@ StateExpectString::custom(gchar chr)
 		if (!machine.input(chr, insert))
 			return this;
 
-		undo.push_str(strings[0]);
-		String::append(strings[0], insert);
-		insert_len += strlen(insert);
+		gsize len = strlen(insert);
+
+		StringArgument::append(insert, len);
+		insert_len += len;
 
 		g_free(insert);
 	} else {
-		undo.push_str(strings[0]);
-		String::append(strings[0], chr);
+		StringArgument::append(chr);
 		insert_len++;
 	}
 
@@ -711,7 +1424,7 @@ StateStart::insert_integer(tecoInt v)
 	ring.dirtify();
 
 	if (current_doc_must_undo())
-		interface.undo_ssm(SCI_UNDO);
+		interface.undo_modification();
 }
 
 tecoInt
@@ -782,6 +1495,9 @@ StateStart::delete_words(tecoInt n)
 	if (!n)
 		return SUCCESS;
 
+	/* reverting with SCI_UNDO requires the undo collection */
+	ViewCurrent::end_snapshot(interface.get_current_view());
+
 	pos = interface.ssm(SCI_GETCURRENTPOS);
 	size = interface.ssm(SCI_GETLENGTH);
 	interface.ssm(SCI_BEGINUNDOACTION);
@@ -820,7 +1536,7 @@ StateStart::delete_words(tecoInt n)
 
 	interface.undo_ssm(SCI_GOTOPOS, pos);
 	if (current_doc_must_undo())
-		interface.undo_ssm(SCI_UNDO);
+		interface.undo_modification();
 	ring.dirtify();
 
 	return SUCCESS;
@@ -1233,7 +1949,7 @@ StateStart::custom(gchar chr)
 		interface.ssm(SCI_ENDUNDOACTION);
 
 		/* must always support undo on global register */
-		interface.undo_ssm(SCI_UNDO);
+		interface.undo_modification();
 		break;
 
 	case '}':
@@ -1595,15 +2311,16 @@ StateStart::custom(gchar chr)
 		if (len == 0 || IS_FAILURE(rc))
 			break;
 
-		if (current_doc_must_undo()) {
+		if (current_doc_must_undo())
 			interface.undo_ssm(SCI_GOTOPOS, interface.ssm(SCI_GETCURRENTPOS));
-			interface.undo_ssm(SCI_UNDO);
-		}
 
 		interface.ssm(SCI_BEGINUNDOACTION);
 		interface.ssm(SCI_DELETERANGE, from, len);
 		interface.ssm(SCI_ENDUNDOACTION);
 		ring.dirtify();
+
+		if (current_doc_must_undo())
+			interface.undo_modification();
 		break;
 	}
 
@@ -1655,6 +2372,10 @@ StateFCommand::StateFCommand()
 	transitions['D'] = &States::searchdelete;
 	transitions['S'] = &States::replace;
 	transitions['R'] = &States::replacedefault;
+	transitions['A'] = &States::replaceall;
+	transitions['M'] = &States::searchmulti;
+	transitions['N'] = &States::searchallmulti;
+	transitions['F'] = &States::grep;
 	transitions['G'] = &States::changedir;
 }
 
@@ -2789,7 +3510,7 @@ StateInsert::initial(void)
 	ring.dirtify();
 
 	if (current_doc_must_undo())
-		interface.undo_ssm(SCI_UNDO);
+		interface.undo_modification();
 }
 
 void
@@ -2803,7 +3524,7 @@ StateInsert::process(const gchar *str, gint new_chars)
 	ring.dirtify();
 
 	if (current_doc_must_undo())
-		interface.undo_ssm(SCI_UNDO);
+		interface.undo_modification();
 }
 
 State *
@@ -2877,7 +3598,7 @@ StateInsertIndent::initial(void)
 	ring.dirtify();
 
 	if (current_doc_must_undo())
-		interface.undo_ssm(SCI_UNDO);
+		interface.undo_modification();
 }
 
 } /* namespace SciTECO */
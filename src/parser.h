@@ -455,6 +455,31 @@ extern gint macro_pc;
 extern gchar *strings[2];
 extern gchar escape_char;
 
+/**
+ * Accumulation of the current string argument
+ * in strings[0].
+ *
+ * Appending is amortized linear-time and the undo
+ * tokens generated only record the previous length.
+ * strings[0] must therefore only be modified using
+ * these functions.
+ */
+namespace StringArgument {
+	void append(const gchar *str, gsize len);
+	static inline void
+	append(const gchar *str)
+	{
+		append(str, strlen(str));
+	}
+	static inline void
+	append(gchar chr)
+	{
+		append(&chr, 1);
+	}
+
+	gchar *take(void);
+}
+
 struct LoopContext {
 	/** how many iterations are left */
 	tecoInt counter;
@@ -474,9 +499,98 @@ struct LoopContext {
 typedef ValueStack<LoopContext> LoopStack;
 extern LoopStack loop_stack;
 
+/**
+ * Cached copy of macro code for repeated execution.
+ *
+ * Note that the code is still interpreted character
+ * by character - nothing is compiled.
+ *
+ * Cached macros own a copy of their code, so executing
+ * them does not require fetching the code again, e.g. from
+ * a Q-Register's Scintilla document.
+ * They are reference counted since they may be invalidated
+ * while still being executed, e.g. when a macro modifies
+ * the Q-Register it has been cached from.
+ *
+ * Cached macros also keep an index of parse-only skips,
+ * i.e. gotos to labels not yet defined, loop exits and
+ * skipped conditionals.
+ * Since parsing never depends on runtime state, the end of
+ * a skip only depends on where it starts and the parser
+ * state at that point.
+ * Therefore, skips are recorded when they are first performed
+ * and subsequent skips from the same program counter can
+ * jump directly to their target.
+ * The index of macro files is persisted in the user's
+ * cache directory (see Execute::file()).
+ */
+class CachedMacro : public Object {
+	guint ref_count;
+
+	class Skip;
+	/**
+	 * Index of recorded skips, mapping program counters
+	 * to lists of Skip objects.
+	 */
+	GHashTable *skips;
+	/** Whether skips have been recorded since the index was loaded */
+	bool skips_modified;
+
+	/**
+	 * Skip currently being recorded or NULL.
+	 * There can only be one, since no macro is
+	 * executed while skipping.
+	 */
+	static Skip *recording;
+
+	~CachedMacro();
+
+	void add_skip(Skip *skip);
+
+public:
+	/** Null-terminated macro code */
+	gchar *code;
+
+	/**
+	 * Construct cached macro.
+	 *
+	 * This passes ownership of the code string
+	 * to the new object.
+	 */
+	CachedMacro(gchar *_code)
+	           : ref_count(1), skips(NULL), skips_modified(false),
+	             code(_code) {}
+
+	inline CachedMacro *
+	ref(void)
+	{
+		ref_count++;
+		return this;
+	}
+
+	inline void
+	unref(void)
+	{
+		if (!--ref_count)
+			delete this;
+	}
+
+	bool replay_skip(gint pc);
+	void begin_skip(gint pc);
+	void end_skip(gint pc);
+
+	bool load_skips(const gchar *filename, const gchar *key);
+	void save_skips(const gchar *filename, const gchar *key);
+
+	static void record_label(const gchar *name, gint pc);
+	static void cancel_skip(void);
+};
+
 namespace Execute {
-	void step(const gchar *macro, gint stop_pos);
-	void macro(const gchar *macro, bool locals = true);
+	void step(const gchar *macro, gint stop_pos,
+	          CachedMacro *cached = NULL);
+	void macro(const gchar *macro, bool locals = true,
+	           CachedMacro *cached = NULL);
 	void file(const gchar *filename, bool locals = true);
 }
 
@@ -217,6 +217,12 @@ QRegisterData::undo_exchange_string(QRegisterData &reg)
 void
 QRegister::edit(void)
 {
+	/*
+	 * Edited registers are modified directly
+	 * via the view.
+	 */
+	invalidate();
+
 	if (QRegisters::current)
 		QRegisters::current->string.update(QRegisters::view);
 
@@ -242,24 +248,43 @@ QRegister::undo_edit(void)
 	interface.undo_show_view(&QRegisters::view);
 }
 
+/**
+ * Execute the register's string as a macro.
+ *
+ * The macro string is cached, so repeated invocations
+ * of the same register do not have to fetch its string
+ * from the Scintilla document again.
+ * The cache is bypassed for the currently edited register
+ * and for registers with undo in interactive mode, since
+ * their string might change without invalidating the cache.
+ */
 void
 QRegister::execute(bool locals)
 {
-	gchar *str = get_string();
+	CachedMacro *macro;
+
+	if (is_cacheable() && this != QRegisters::current &&
+	    (!undo.enabled || !must_undo)) {
+		if (!cached_macro)
+			cached_macro = new CachedMacro(get_string());
+		macro = cached_macro->ref();
+	} else {
+		macro = new CachedMacro(get_string());
+	}
 
 	try {
-		Execute::macro(str, locals);
+		Execute::macro(macro->code, locals, macro);
 	} catch (Error &error) {
 		error.add_frame(new Error::QRegFrame(name));
 
-		g_free(str);
+		macro->unref();
 		throw; /* forward */
 	} catch (...) {
-		g_free(str);
+		macro->unref();
 		throw; /* forward */
 	}
 
-	g_free(str);
+	macro->unref();
 }
 
 void
@@ -300,6 +325,7 @@ void
 QRegister::load(const gchar *filename)
 {
 	undo_set_string();
+	invalidate();
 
 	if (QRegisters::current)
 		QRegisters::current->string.update(QRegisters::view);
@@ -1483,7 +1509,7 @@ StateGetQRegString::got_register(QRegister *reg)
 		interface.ssm(SCI_ENDUNDOACTION);
 		ring.dirtify();
 
-		interface.undo_ssm(SCI_UNDO);
+		interface.undo_modification();
 	}
 	g_free(str);
 
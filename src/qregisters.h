@@ -136,18 +136,77 @@ public:
 };
 
 class QRegister : public RBTreeString::RBEntryOwnString, public QRegisterData {
+	/**
+	 * Cached copy of the register's string
+	 * (see execute()) or NULL.
+	 */
+	CachedMacro *cached_macro;
+
 protected:
 	/**
 	 * The default constructor for subclasses.
 	 * This leaves the name uninitialized.
 	 */
-	QRegister() {}
+	QRegister() : cached_macro(NULL) {}
+
+	/**
+	 * Discard the cached macro.
+	 * This must be called whenever the register's
+	 * string may change.
+	 */
+	inline void
+	invalidate(void)
+	{
+		if (cached_macro) {
+			cached_macro->unref();
+			cached_macro = NULL;
+		}
+	}
+
+	/**
+	 * Whether the register's string may be
+	 * cached by execute().
+	 * This is not the case for registers whose
+	 * string is not backed by their own document.
+	 */
+	virtual bool
+	is_cacheable(void)
+	{
+		return true;
+	}
 
 public:
 	QRegister(const gchar *name)
-		 : RBTreeString::RBEntryOwnString(name) {}
+		 : RBTreeString::RBEntryOwnString(name),
+		   cached_macro(NULL) {}
 
-	virtual ~QRegister() {}
+	virtual ~QRegister()
+	{
+		invalidate();
+	}
+
+	using QRegisterData::set_string;
+	void
+	set_string(const gchar *str, gsize len)
+	{
+		invalidate();
+		QRegisterData::set_string(str, len);
+	}
+
+	using QRegisterData::append_string;
+	void
+	append_string(const gchar *str, gsize len)
+	{
+		invalidate();
+		QRegisterData::append_string(str, len);
+	}
+
+	void
+	exchange_string(QRegisterData &reg)
+	{
+		invalidate();
+		QRegisterData::exchange_string(reg);
+	}
 
 	virtual void edit(void);
 	virtual void undo_edit(void);
@@ -166,6 +225,12 @@ public:
 };
 
 class QRegisterBufferInfo : public QRegister {
+	bool
+	is_cacheable(void)
+	{
+		return false;
+	}
+
 public:
 	QRegisterBufferInfo() : QRegister("*") {}
 
@@ -197,6 +262,12 @@ public:
 };
 
 class QRegisterWorkingDir : public QRegister {
+	bool
+	is_cacheable(void)
+	{
+		return false;
+	}
+
 public:
 	QRegisterWorkingDir() : QRegister("$") {}
 
@@ -254,6 +325,12 @@ class QRegisterClipboard : public QRegister {
 		return name+1;
 	}
 
+	bool
+	is_cacheable(void)
+	{
+		return false;
+	}
+
 public:
 	QRegisterClipboard(const gchar *_name = NULL)
 	{
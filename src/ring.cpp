@@ -433,6 +433,16 @@ StateEditFile::got_file(const gchar *filename)
  * Otherwise save point files are deleted on command line
  * termination.
  *
+ * On file systems supporting reflinks (e.g. Btrfs and XFS
+ * on Linux), the save point file is instead created as a
+ * copy-on-write clone of the original file, which does not
+ * require any on-disk copying either, and the file is
+ * overwritten in place.
+ * This preserves the file's owner, permissions and hard links.
+ * Save point clones are left behind just like renamed save
+ * point files when \*(ST crashes, so the original contents
+ * can always be recovered.
+ *
  * File names may also be tab-completed and string building
  * characters are enabled by default.
  */
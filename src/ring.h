@@ -61,6 +61,12 @@ public:
 	gchar *filename;
 	bool dirty;
 
+	/*
+	 * Buffers may be queried without editing them,
+	 * e.g. to search them.
+	 */
+	using IOView::ssm;
+
 	Buffer() : filename(NULL), dirty(false)
 	{
 		initialize();
@@ -33,6 +33,7 @@
 #include "parser.h"
 #include "search.h"
 #include "error.h"
+#include "workers.h"
 
 namespace SciTECO {
 
@@ -41,16 +42,170 @@ namespace States {
 	StateSearchAll			searchall;
 	StateSearchKill			searchkill;
 	StateSearchDelete		searchdelete;
+	StateSearch			searchmulti(true, true);
+	StateSearchAll			searchallmulti(true);
 
 	StateReplace			replace;
 	StateReplace_insert		replace_insert;
 	StateReplace_ignore		replace_ignore;
 
+	StateReplaceAll			replaceall;
+	StateReplaceAll_insert		replaceall_insert;
+
 	StateReplaceDefault		replacedefault;
 	StateReplaceDefault_insert	replacedefault_insert;
 	StateReplaceDefault_ignore	replacedefault_ignore;
 }
 
+/**
+ * Size of the first window searched by backward searches
+ * (see search_range()).
+ */
+#define SEARCH_WINDOW_MIN (16*1024)
+
+/**
+ * Minimum number of bytes to search in other buffers
+ * of the ring before using several threads
+ * (see StateSearch::search_ring()).
+ */
+#define SEARCH_PARALLEL_MIN (1024*1024)
+
+/**
+ * Maximum size of the stack used by JIT-compiled
+ * regular expressions.
+ */
+#define REGEXP_JIT_STACK_MAX (1024*1024)
+
+/**
+ * Least recently used cache of compiled regular expressions.
+ *
+ * Searches in loops and search-as-you-type compile the
+ * same regular expressions over and over again, which
+ * can take longer than the search itself - especially
+ * when they are JIT-compiled.
+ *
+ * The cache is keyed by the translated regular expression
+ * instead of the SciTECO pattern, since patterns may refer
+ * to Q-Register contents (^EGq).
+ */
+static class RegexpCache : public Object {
+	/** Maximum number of cached regular expressions */
+	static const guint size = 32;
+
+	struct Entry {
+		gchar *pattern;
+		Regexp *re;
+	};
+
+	/** Cached regular expressions, most recently used first */
+	Entry entries[size];
+	guint length;
+
+	static Regexp *compile(const gchar *pattern);
+	static void unref(Regexp *re);
+
+public:
+	/** Statistics for debugging */
+	guint hits, misses;
+
+	RegexpCache() : length(0), hits(0), misses(0) {}
+	~RegexpCache()
+	{
+		for (guint i = 0; i < length; i++) {
+			g_free(entries[i].pattern);
+			unref(entries[i].re);
+		}
+	}
+
+	Regexp *get(const gchar *pattern);
+} regexp_cache;
+
+Regexp *
+RegexpCache::compile(const gchar *pattern)
+{
+#ifdef HAVE_PCRE2
+	pcre2_code *re;
+	int error;
+	PCRE2_SIZE error_offset;
+
+	re = pcre2_compile((PCRE2_SPTR)pattern, PCRE2_ZERO_TERMINATED,
+	                   PCRE2_CASELESS | PCRE2_MULTILINE | PCRE2_DOTALL,
+	                   &error, &error_offset, NULL);
+	if (re)
+		/* if this fails, pcre2_match() falls back to the interpreter */
+		pcre2_jit_compile(re, PCRE2_JIT_COMPLETE);
+
+	return re;
+#else
+	static const gint flags = G_REGEX_CASELESS | G_REGEX_MULTILINE |
+				  G_REGEX_DOTALL | G_REGEX_RAW;
+
+	return g_regex_new(pattern, (GRegexCompileFlags)flags,
+	                   (GRegexMatchFlags)0, NULL);
+#endif
+}
+
+void
+RegexpCache::unref(Regexp *re)
+{
+#ifdef HAVE_PCRE2
+	pcre2_code_free(re);
+#else
+	g_regex_unref(re);
+#endif
+}
+
+/**
+ * Get compiled regular expression, compiling it
+ * only if it is not already cached.
+ *
+ * @param pattern The regular expression.
+ * @return The compiled regular expression or NULL
+ *         if it could not be compiled.
+ *         It is owned by the cache and is only
+ *         guaranteed to be valid until the next lookup.
+ */
+Regexp *
+RegexpCache::get(const gchar *pattern)
+{
+	Entry entry;
+	guint i;
+
+	for (i = 0; i < length; i++)
+		if (!strcmp(entries[i].pattern, pattern))
+			break;
+
+	if (i < length) {
+		hits++;
+		entry = entries[i];
+	} else {
+		misses++;
+		entry.re = compile(pattern);
+		if (!entry.re)
+			return NULL;
+		entry.pattern = g_strdup(pattern);
+
+		if (length < size) {
+			i = length++;
+		} else {
+			/* evict least recently used entry */
+			i = length-1;
+			g_free(entries[i].pattern);
+			unref(entries[i].re);
+		}
+	}
+
+	/* move to front */
+	memmove(entries+1, entries, i*sizeof(Entry));
+	entries[0] = entry;
+
+#ifdef DEBUG
+	g_printf("REGEXP CACHE: %u hits, %u misses\n", hits, misses);
+#endif
+
+	return entry.re;
+}
+
 /*
  * Command states
  */
@@ -109,7 +264,8 @@ namespace States {
  * (\(lqsearch as you type\(rq) highlighting matched text
  * on the fly.
  * Changing the <pattern> results in the search being reperformed
- * from the beginning.
+ * from the beginning, unless a pattern without any match
+ * constructs is only extended.
  */
 void
 StateSearch::initial(void)
@@ -150,6 +306,9 @@ StateSearch::initial(void)
 
 	parameters.from_buffer = QRegisters::current ? NULL : ring.current;
 	parameters.to_buffer = NULL;
+
+	undo.push_var(resume);
+	resume.pattern_len = -1;
 }
 
 static inline const gchar *
@@ -467,42 +626,128 @@ incomplete:
 	return NULL;
 }
 
-void
-StateSearch::do_search(GRegex *re, gint from, gint to, gint &count)
+#ifdef HAVE_PCRE2
+
+/**
+ * JIT stack of the current thread.
+ * The default JIT stack is rather small for patterns
+ * like ^EM, so we allocate one per thread that is kept
+ * until the thread terminates.
+ * Stacks must not be shared by threads.
+ */
+static GPrivate jit_stack =
+	G_PRIVATE_INIT((GDestroyNotify)pcre2_jit_stack_free);
+
+static pcre2_jit_stack *
+get_jit_stack(void *data)
 {
-	GMatchInfo *info;
-	const gchar *buffer;
+	pcre2_jit_stack *stack = (pcre2_jit_stack *)g_private_get(&jit_stack);
 
-	gint matched_from = -1, matched_to = -1;
+	if (G_UNLIKELY(!stack)) {
+		stack = pcre2_jit_stack_create(32*1024, REGEXP_JIT_STACK_MAX, NULL);
+		g_private_set(&jit_stack, stack);
+	}
+
+	return stack;
+}
 
-	buffer = (const gchar *)interface.ssm(SCI_GETCHARACTERPOINTER);
-	g_regex_match_full(re, buffer, (gssize)to, from,
-			   (GRegexMatchFlags)0, &info, NULL);
+RegexpMatcher::RegexpMatcher(Regexp *_re) : re(_re)
+{
+	context = pcre2_match_context_create(NULL);
+	pcre2_jit_stack_assign(context, get_jit_stack, NULL);
+}
+
+/*
+ * Both regular expression backends iterate matches like Perl:
+ * After an empty match, a non-empty match is tried at the
+ * same position (anchored) before advancing by one byte.
+ * Since patterns are matched in raw (8-bit) mode, advancing
+ * by a byte never splits a character.
+ */
+
+/**
+ * Find the next match.
+ *
+ * @param match_data Match data block for one match.
+ * @param range The memory to search.
+ * @param len Length of the range in bytes.
+ * @param pos Position to search from.
+ *            Updated with the position to search
+ *            the next match from.
+ * @param after_empty Whether the previous match was empty.
+ *                    Initially false and updated for the
+ *                    next call.
+ * @param matched_from Start of the match.
+ * @param matched_to End of the match.
+ * @return Whether there was a match.
+ */
+bool
+RegexpMatcher::match(pcre2_match_data *match_data,
+                     const gchar *range, gint len,
+                     gint &pos, bool &after_empty,
+                     gint &matched_from, gint &matched_to) const
+{
+	PCRE2_SIZE *ovector;
+
+	for (;;) {
+		uint32_t options = after_empty
+			? PCRE2_NOTEMPTY_ATSTART | PCRE2_ANCHORED : 0;
+
+		if (pos > len)
+			return false;
+		if (pcre2_match(re, (PCRE2_SPTR)range, len, pos, options,
+		                match_data, context) >= 0)
+			break;
+		if (!after_empty)
+			return false;
+
+		/* no non-empty match at the position of the empty match */
+		after_empty = false;
+		pos++;
+	}
+
+	ovector = pcre2_get_ovector_pointer(match_data);
+	matched_from = ovector[0];
+	matched_to = ovector[1];
 
+	pos = matched_to;
+	after_empty = matched_to == matched_from;
+	return true;
+}
+
+void
+RegexpMatcher::search(const gchar *range, gint len, gint &count,
+                      gint &matched_from, gint &matched_to) const
+{
+	pcre2_match_data *match_data = pcre2_match_data_create(1, NULL);
+	gint pos = 0, from, to;
+	bool after_empty = false;
+
+	/*
+	 * NOTE: Since the regular expressions generated from
+	 * SciTECO patterns contain no anchors or lookbehinds,
+	 * the characters before the range are irrelevant.
+	 */
 	if (count >= 0) {
-		while (g_match_info_matches(info) && --count)
-			g_match_info_next(info, NULL);
+		while (match(match_data, range, len, pos, after_empty,
+		             from, to) && --count);
 
-		if (!count)
+		if (!count) {
 			/* successful */
-			g_match_info_fetch_pos(info, 0,
-					       &matched_from, &matched_to);
+			matched_from = from;
+			matched_to = to;
+		}
 	} else {
 		/* only keep the last `count' matches, in a circular stack */
 		struct Range {
 			gint from, to;
 		};
-		Range *matched = new Range[-count];
+		Range *matched = g_new(Range, -count);
 		gint matched_total = 0, i = 0;
 
-		while (g_match_info_matches(info)) {
-			g_match_info_fetch_pos(info, 0,
-					       &matched[i].from,
-					       &matched[i].to);
-
-			g_match_info_next(info, NULL);
+		while (match(match_data, range, len, pos, after_empty,
+		             matched[i].from, matched[i].to))
 			i = ++matched_total % -count;
-		}
 
 		count = MIN(count + matched_total, 0);
 		if (!count) {
@@ -511,200 +756,1199 @@ StateSearch::do_search(GRegex *re, gint from, gint to, gint &count)
 			matched_to = matched[i].to;
 		}
 
-		delete[] matched;
+		g_free(matched);
 	}
 
-	g_match_info_free(info);
-
-	if (matched_from >= 0 && matched_to >= 0)
-		/* match success */
-		interface.ssm(SCI_SETSEL, matched_from, matched_to);
+	pcre2_match_data_free(match_data);
 }
 
 void
-StateSearch::process(const gchar *str, gint new_chars)
+RegexpMatcher::find_all(const gchar *range, gint len, gint max_count,
+                        GArray *occurrences) const
 {
-	static const gint flags = G_REGEX_CASELESS | G_REGEX_MULTILINE |
-				  G_REGEX_DOTALL | G_REGEX_RAW;
+	pcre2_match_data *match_data = pcre2_match_data_create(1, NULL);
+	Occurrence occurrence;
+	gint pos = 0;
+	bool after_empty = false;
 
-	QRegister *search_reg = QRegisters::globals["_"];
+	while (max_count-- > 0 &&
+	       match(match_data, range, len, pos, after_empty,
+	             occurrence.from, occurrence.to))
+		g_array_append_val(occurrences, occurrence);
 
-	gchar *re_pattern;
-	GRegex *re;
+	pcre2_match_data_free(match_data);
+}
 
-	gint count = parameters.count;
+#else /* !HAVE_PCRE2 */
 
-	if (current_doc_must_undo())
-		interface.undo_ssm(SCI_SETSEL,
-		                   interface.ssm(SCI_GETANCHOR),
-		                   interface.ssm(SCI_GETCURRENTPOS));
+/**
+ * Find the next match.
+ *
+ * This does not use g_match_info_next() which
+ * does not retry non-empty matches after empty ones.
+ * Older versions of GLib (before 2.34) do not support
+ * this either, so they always advance after empty matches.
+ *
+ * @param range The memory to search.
+ * @param len Length of the range in bytes.
+ * @param pos Position to search from.
+ *            Updated with the position to search
+ *            the next match from.
+ * @param after_empty Whether the previous match was empty.
+ *                    Initially false and updated for the
+ *                    next call.
+ * @param matched_from Start of the match.
+ * @param matched_to End of the match.
+ * @return Whether there was a match.
+ */
+bool
+RegexpMatcher::match(const gchar *range, gint len,
+                     gint &pos, bool &after_empty,
+                     gint &matched_from, gint &matched_to) const
+{
+	GMatchInfo *info;
 
-	search_reg->undo_set_integer();
-	search_reg->set_integer(FAILURE);
+	for (;;) {
+		gint flags = 0;
 
-	/*
-	 * NOTE: pattern2regexp() modifies str pointer and may throw
-	 */
-	re_pattern = pattern2regexp(str);
-	qreg_machine.reset();
-#ifdef DEBUG
-	g_printf("REGEXP: %s\n", re_pattern);
+		if (after_empty) {
+#if GLIB_CHECK_VERSION(2,34,0)
+			flags = G_REGEX_MATCH_NOTEMPTY_ATSTART |
+			        G_REGEX_MATCH_ANCHORED;
+#else
+			after_empty = false;
+			pos++;
 #endif
-	if (!re_pattern)
-		goto failure;
-	re = g_regex_new(re_pattern, (GRegexCompileFlags)flags,
-			 (GRegexMatchFlags)0, NULL);
-	g_free(re_pattern);
-	if (!re)
-		goto failure;
+		}
 
-	if (!QRegisters::current &&
-	    ring.current != parameters.from_buffer) {
-		ring.undo_edit();
-		parameters.from_buffer->edit();
+		if (pos > len)
+			return false;
+		if (g_regex_match_full(re, range, (gssize)len, pos,
+		                       (GRegexMatchFlags)flags, &info, NULL))
+			break;
+		g_match_info_free(info);
+		if (!after_empty)
+			return false;
+
+		/* no non-empty match at the position of the empty match */
+		after_empty = false;
+		pos++;
 	}
 
-	do_search(re, parameters.from, parameters.to, count);
+	g_match_info_fetch_pos(info, 0, &matched_from, &matched_to);
+	g_match_info_free(info);
 
-	if (parameters.to_buffer && count) {
-		Buffer *buffer = parameters.from_buffer;
+	pos = matched_to;
+	after_empty = matched_to == matched_from;
+	return true;
+}
 
-		if (ring.current == buffer)
-			ring.undo_edit();
+void
+RegexpMatcher::search(const gchar *range, gint len, gint &count,
+                      gint &matched_from, gint &matched_to) const
+{
+	gint pos = 0, from, to;
+	bool after_empty = false;
 
-		if (count > 0) {
-			do {
-				buffer = buffer->next() ? : ring.first();
-				buffer->edit();
+	/*
+	 * NOTE: Since the regular expressions generated from
+	 * SciTECO patterns contain no anchors or lookbehinds,
+	 * the characters before the range are irrelevant.
+	 */
+	if (count >= 0) {
+		while (match(range, len, pos, after_empty, from, to) && --count);
 
-				if (buffer == parameters.to_buffer) {
-					do_search(re, 0, parameters.dot, count);
-					break;
-				}
+		if (!count) {
+			/* successful */
+			matched_from = from;
+			matched_to = to;
+		}
+	} else {
+		/* only keep the last `count' matches, in a circular stack */
+		struct Range {
+			gint from, to;
+		};
+		Range *matched = g_new(Range, -count);
+		gint matched_total = 0, i = 0;
 
-				do_search(re, 0, interface.ssm(SCI_GETLENGTH),
-					  count);
-			} while (count);
-		} else /* count < 0 */ {
-			do {
-				buffer = buffer->prev() ? : ring.last();
-				buffer->edit();
-
-				if (buffer == parameters.to_buffer) {
-					do_search(re, parameters.dot,
-						  interface.ssm(SCI_GETLENGTH),
-						  count);
-					break;
-				}
+		while (match(range, len, pos, after_empty,
+		             matched[i].from, matched[i].to))
+			i = ++matched_total % -count;
 
-				do_search(re, 0, interface.ssm(SCI_GETLENGTH),
-					  count);
-			} while (count);
+		count = MIN(count + matched_total, 0);
+		if (!count) {
+			/* successful, i points to stack bottom */
+			matched_from = matched[i].from;
+			matched_to = matched[i].to;
 		}
 
-		ring.current = buffer;
+		g_free(matched);
 	}
+}
 
-	search_reg->set_integer(TECO_BOOL(!count));
+void
+RegexpMatcher::find_all(const gchar *range, gint len, gint max_count,
+                        GArray *occurrences) const
+{
+	Occurrence occurrence;
+	gint pos = 0;
+	bool after_empty = false;
+
+	while (max_count-- > 0 &&
+	       match(range, len, pos, after_empty,
+	             occurrence.from, occurrence.to))
+		g_array_append_val(occurrences, occurrence);
+}
 
-	g_regex_unref(re);
+#endif
 
-	if (!count)
-		return;
+/**
+ * ASCII case folding table.
+ * Searches are case-insensitive, but like PCRE in
+ * raw mode, only ASCII characters are folded.
+ */
+static class FoldTable {
+	guchar table[256];
+
+public:
+	FoldTable()
+	{
+		for (guint i = 0; i < G_N_ELEMENTS(table); i++)
+			table[i] = g_ascii_tolower(i);
+	}
 
-failure:
-	interface.ssm(SCI_GOTOPOS, parameters.dot);
-}
+	inline guchar
+	operator [](gchar chr) const
+	{
+		return table[(guchar)chr];
+	}
+} fold;
 
-State *
-StateSearch::done(const gchar *str)
+/**
+ * Check whether a SciTECO pattern is a literal string,
+ * i.e. does not contain any pattern match constructs.
+ */
+bool
+LiteralMatcher::is_literal(const gchar *pattern)
 {
-	BEGIN_EXEC(&States::start);
-
-	QRegister *search_reg = QRegisters::globals["_"];
+	if (!*pattern)
+		/* does not match anything */
+		return false;
+
+	for (; *pattern; pattern++) {
+		switch (*pattern) {
+		case CTL_KEY('E'):
+		case CTL_KEY('N'):
+		case CTL_KEY('S'):
+		case CTL_KEY('X'):
+			return false;
+		}
+	}
 
-	if (*str) {
-		/* workaround: preserve selection (also on rubout) */
-		gint anchor = interface.ssm(SCI_GETANCHOR);
-		if (current_doc_must_undo())
-			interface.undo_ssm(SCI_SETANCHOR, anchor);
+	return true;
+}
 
-		search_reg->undo_set_string();
-		search_reg->set_string(str);
+LiteralMatcher::LiteralMatcher(const gchar *_pattern)
+{
+	len = strlen(_pattern);
+	pattern = (gchar *)g_malloc(len);
+	for (gsize i = 0; i < len; i++)
+		pattern[i] = fold[_pattern[i]];
 
-		interface.ssm(SCI_SETANCHOR, anchor);
-	} else {
-		gchar *search_str = search_reg->get_string();
-		process(search_str, 0 /* unused */);
-		g_free(search_str);
+	/*
+	 * The skip table is indexed by unfolded characters,
+	 * so both cases must be initialized.
+	 */
+	for (guint i = 0; i < G_N_ELEMENTS(skip); i++)
+		skip[i] = len;
+	for (gsize i = 0; i+1 < len; i++) {
+		skip[(guchar)pattern[i]] = len-1 - i;
+		skip[(guchar)g_ascii_toupper(pattern[i])] = len-1 - i;
 	}
+}
 
-	if (eval_colon())
-		expressions.push(search_reg->get_integer());
-	else if (IS_FAILURE(search_reg->get_integer()) &&
-	         !loop_stack.items() /* not in loop */)
-		interface.msg(InterfaceCurrent::MSG_ERROR, "Search string not found!");
+/**
+ * Find single-character pattern.
+ * This uses memchr() which is usually vectorized
+ * by the libc.
+ */
+const gchar *
+LiteralMatcher::find_chr(const gchar *p, const gchar *end) const
+{
+	gchar lower = pattern[0];
+	gchar upper = g_ascii_toupper(lower);
+	const gchar *found;
+
+	found = (const gchar *)memchr(p, lower, end - p);
+	if (upper != lower) {
+		/* only scan up to the lower-case occurrence */
+		const gchar *found_upper;
+
+		found_upper = (const gchar *)memchr(p, upper,
+		                                    (found ? : end) - p);
+		if (found_upper)
+			found = found_upper;
+	}
 
-	return &States::start;
+	return found;
 }
 
-/*$ N
- * [n]N[pattern]$ -- Search over buffer-boundaries
- * -N[pattern]$
- * from,toN[pattern]$
- * [n]:N[pattern]$ -> Success|Failure
- * -:N[pattern]$ -> Success|Failure
- * from,to:N[pattern]$ -> Success|Failure
- *
- * Search for <pattern> over buffer boundaries.
- * This command is similar to the regular search command
- * (S) but will continue to search for occurrences of
- * pattern when the end or beginning of the current buffer
- * is reached.
- * Occurrences of <pattern> spanning over buffer boundaries
- * will not be found.
- * When searching forward N will start in the current buffer
- * at dot, continue with the next buffer in the ring searching
- * the entire buffer until it reaches the end of the buffer
- * ring, continue with the first buffer in the ring until
- * reaching the current file again where it searched from the
- * beginning of the buffer up to its current dot.
- * Searching backwards does the reverse.
+/**
+ * Find the first occurrence of the pattern.
  *
- * N also differs from S in the interpretation of two arguments.
- * Using two arguments the search will be bounded between the
- * buffer with number <from>, up to the buffer with number
- * <to>.
- * When specifying buffer ranges, the entire buffers are searched
- * from beginning to end.
- * <from> may be greater than <to> in which case, searching starts
- * at the end of buffer <from> and continues backwards until the
- * beginning of buffer <to> has been reached.
- * Furthermore as with all buffer numbers, the buffer ring
- * is considered a circular structure and it is possible
- * to search over buffer ring boundaries by specifying
- * buffer numbers greater than the number of buffers in the
- * ring.
+ * @param p Beginning of the memory to search.
+ * @param end End of the memory to search.
+ * @return Pointer to the occurrence or NULL.
  */
-void
-StateSearchAll::initial(void)
+const gchar *
+LiteralMatcher::find(const gchar *p, const gchar *end) const
 {
-	tecoInt v1, v2;
+	if ((gsize)(end - p) < len)
+		return NULL;
+	if (len == 1)
+		return find_chr(p, end);
 
-	undo.push_var(parameters);
+	const gchar *last = end - len;
+	gchar last_chr = pattern[len-1];
 
-	parameters.dot = interface.ssm(SCI_GETCURRENTPOS);
+	while (p <= last) {
+		gchar chr = p[len-1];
 
-	v2 = expressions.pop_num_calc();
-	if (expressions.args()) {
-		/* TODO: optional count argument? */
-		v1 = expressions.pop_num_calc();
-		if (v1 <= v2) {
-			parameters.count = 1;
-			parameters.from_buffer = ring.find(v1);
-			parameters.to_buffer = ring.find(v2);
-		} else {
-			parameters.count = -1;
+		if (fold[chr] == last_chr) {
+			gsize i = 0;
+
+			while (i < len-1 && fold[p[i]] == pattern[i])
+				i++;
+			if (i == len-1)
+				return p;
+		}
+
+		p += skip[(guchar)chr];
+	}
+
+	return NULL;
+}
+
+void
+LiteralMatcher::search(const gchar *range, gint range_len, gint &count,
+                       gint &matched_from, gint &matched_to) const
+{
+	const gchar *p = range, *end = range + range_len;
+
+	if (count >= 0) {
+		while ((p = find(p, end)) && --count)
+			p += len;
+
+		if (!count && p) {
+			/* successful */
+			matched_from = p - range;
+			matched_to = matched_from + len;
+		}
+	} else {
+		/* only keep the last `count' matches, in a circular stack */
+		gint *matched = g_new(gint, -count);
+		gint matched_total = 0, i = 0;
+
+		while ((p = find(p, end))) {
+			matched[i] = p - range;
+			p += len;
+			i = ++matched_total % -count;
+		}
+
+		count = MIN(count + matched_total, 0);
+		if (!count) {
+			/* successful, i points to stack bottom */
+			matched_from = matched[i];
+			matched_to = matched_from + len;
+		}
+
+		g_free(matched);
+	}
+}
+
+void
+LiteralMatcher::find_all(const gchar *range, gint range_len, gint max_count,
+                         GArray *occurrences) const
+{
+	const gchar *p = range, *end = range + range_len;
+
+	while (max_count-- > 0 && (p = find(p, end))) {
+		Occurrence occurrence;
+
+		occurrence.from = p - range;
+		occurrence.to = occurrence.from + len;
+		g_array_append_val(occurrences, occurrence);
+
+		p += len;
+	}
+}
+
+/**
+ * Build the Aho-Corasick automaton.
+ *
+ * @param patterns Newline-separated list of patterns.
+ *                 Empty lines are ignored and a trailing
+ *                 carriage return is not part of a pattern.
+ */
+MultiMatcher::MultiMatcher(const gchar *patterns)
+                          : max_len(0), num_classes(1), num_states(1)
+{
+	guint alloc_states = 64;
+	gint *fail;
+	guint *queue, head = 0, tail = 0;
+
+	pattern_lens = g_array_new(FALSE, FALSE, sizeof(gint));
+
+	/*
+	 * Bytes that do not occur in any pattern share
+	 * the class 0.
+	 * Both cases of a character share a class, which
+	 * makes the automaton case-insensitive.
+	 */
+	memset(classes, 0, sizeof(classes));
+	for (const gchar *p = patterns; *p; p++) {
+		guchar chr = fold[*p];
+
+		if (*p == '\n' || classes[chr])
+			continue;
+		classes[chr] = num_classes;
+		classes[(guchar)g_ascii_toupper(chr)] = num_classes;
+		num_classes++;
+	}
+
+	delta = g_new(gint, alloc_states*num_classes);
+	output = g_new(gint, alloc_states);
+	for (guint i = 0; i < num_classes; i++)
+		delta[i] = -1;
+	output[0] = -1;
+
+	/*
+	 * Insert all patterns into the trie
+	 */
+	while (*patterns) {
+		const gchar *end = strchr(patterns, '\n')
+		                        ? : patterns + strlen(patterns);
+		gint len = end - patterns;
+		guint state = 0;
+
+		if (len > 0 && end[-1] == '\r')
+			len--;
+
+		for (gint i = 0; i < len; i++) {
+			gint *next = delta + state*num_classes +
+			             classes[(guchar)patterns[i]];
+
+			if (*next < 0) {
+				if (num_states == alloc_states) {
+					alloc_states *= 2;
+					delta = g_renew(gint, delta,
+					                alloc_states*num_classes);
+					output = g_renew(gint, output, alloc_states);
+					next = delta + state*num_classes +
+					       classes[(guchar)patterns[i]];
+				}
+
+				for (guint c = 0; c < num_classes; c++)
+					delta[num_states*num_classes + c] = -1;
+				output[num_states] = -1;
+				*next = num_states++;
+			}
+
+			state = *next;
+		}
+
+		/* for duplicate patterns, the first one wins */
+		if (len > 0 && output[state] < 0) {
+			output[state] = pattern_lens->len;
+			g_array_append_val(pattern_lens, len);
+			max_len = MAX(max_len, len);
+		}
+
+		patterns = *end ? end+1 : end;
+	}
+
+	/*
+	 * Add the failure transitions breadth-first, so the
+	 * failure state of every state has already been
+	 * completed, turning the trie into a DFA.
+	 */
+	fail = g_new(gint, num_states);
+	queue = g_new(guint, num_states);
+
+	for (guint c = 0; c < num_classes; c++) {
+		if (delta[c] < 0) {
+			delta[c] = 0;
+		} else {
+			fail[delta[c]] = 0;
+			queue[tail++] = delta[c];
+		}
+	}
+
+	while (head < tail) {
+		guint state = queue[head++];
+
+		for (guint c = 0; c < num_classes; c++) {
+			gint *next = delta + state*num_classes + c;
+			gint fallback = delta[fail[state]*num_classes + c];
+
+			if (*next < 0) {
+				*next = fallback;
+				continue;
+			}
+
+			fail[*next] = fallback;
+			/*
+			 * The longest pattern ending in a state is either
+			 * the state's own one or the longest pattern
+			 * of its failure state.
+			 */
+			if (output[*next] < 0)
+				output[*next] = output[fallback];
+			queue[tail++] = *next;
+		}
+	}
+
+	g_free(queue);
+	g_free(fail);
+}
+
+MultiMatcher::~MultiMatcher()
+{
+	g_free(output);
+	g_free(delta);
+	g_array_free(pattern_lens, TRUE);
+}
+
+/**
+ * Find the leftmost occurrence of any pattern.
+ * Among occurrences beginning at the same position,
+ * the longest one is found.
+ *
+ * @param p Beginning of the memory to search.
+ * @param end End of the memory to search.
+ * @param matched_len Length of the occurrence found.
+ * @param matched_pattern Index of the pattern found.
+ * @return Pointer to the occurrence or NULL.
+ */
+const gchar *
+MultiMatcher::find(const gchar *p, const gchar *end,
+                   gint &matched_len, gint &matched_pattern) const
+{
+	const gchar *found = NULL;
+	gint state = 0;
+
+	for (; p < end; p++) {
+		gint pattern;
+
+		state = delta[state*num_classes + classes[(guchar)*p]];
+		pattern = output[state];
+
+		if (pattern >= 0) {
+			gint len = g_array_index(pattern_lens, gint, pattern);
+
+			/* occurrences ending later must be longer */
+			if (!found || p+1 - len <= found) {
+				found = p+1 - len;
+				matched_len = len;
+				matched_pattern = pattern;
+			}
+		}
+
+		/* no later occurrence can begin at or before `found` */
+		if (found && p+1 - max_len >= found)
+			break;
+	}
+
+	return found;
+}
+
+void
+MultiMatcher::search(const gchar *range, gint range_len, gint &count,
+                     gint &matched_from, gint &matched_to) const
+{
+	const gchar *p = range, *end = range + range_len;
+	gint len, pattern;
+
+	if (count >= 0) {
+		while ((p = find(p, end, len, pattern)) && --count)
+			p += len;
+
+		if (!count && p) {
+			/* successful */
+			matched_from = p - range;
+			matched_to = matched_from + len;
+		}
+	} else {
+		/* only keep the last `count' matches, in a circular stack */
+		struct Match {
+			gint from, len;
+		};
+		Match *matched = g_new(Match, -count);
+		gint matched_total = 0, i = 0;
+
+		while ((p = find(p, end, len, pattern))) {
+			matched[i].from = p - range;
+			matched[i].len = len;
+			p += len;
+			i = ++matched_total % -count;
+		}
+
+		count = MIN(count + matched_total, 0);
+		if (!count) {
+			/* successful, i points to stack bottom */
+			matched_from = matched[i].from;
+			matched_to = matched_from + matched[i].len;
+		}
+
+		g_free(matched);
+	}
+}
+
+/**
+ * Get the pattern an occurrence is an instance of.
+ *
+ * @param occurrence The text of an occurrence found
+ *                   by this matcher.
+ * @param len Length of the occurrence.
+ * @return Index of the pattern.
+ */
+gint
+MultiMatcher::get_pattern(const gchar *occurrence, gint len) const
+{
+	gint state = 0;
+
+	/*
+	 * Every pattern is a state of the trie, so this
+	 * only follows trie transitions and ends in the
+	 * state of the pattern itself.
+	 */
+	for (gint i = 0; i < len; i++)
+		state = delta[state*num_classes + classes[(guchar)occurrence[i]]];
+
+	return output[state];
+}
+
+void
+MultiMatcher::find_all(const gchar *range, gint range_len, gint max_count,
+                       GArray *occurrences) const
+{
+	const gchar *p = range, *end = range + range_len;
+	gint len, pattern;
+
+	while (max_count-- > 0 && (p = find(p, end, len, pattern))) {
+		Occurrence occurrence;
+
+		occurrence.from = p - range;
+		occurrence.to = occurrence.from + len;
+		g_array_append_val(occurrences, occurrence);
+
+		p += len;
+	}
+}
+
+/**
+ * Create the matcher for a SciTECO pattern.
+ *
+ * @param pattern The SciTECO pattern or the list of
+ *                patterns for multi-pattern searches.
+ * @return A new matcher (must be deleted) or NULL
+ *         if the pattern is incomplete or does not
+ *         match anything.
+ */
+SearchMatcher *
+StateSearch::new_matcher(const gchar *pattern)
+{
+	gchar *re_pattern;
+	Regexp *re;
+
+	if (multi) {
+		MultiMatcher *matcher = new MultiMatcher(pattern);
+
+		if (!matcher->size()) {
+			/* does not match anything */
+			delete matcher;
+			return NULL;
+		}
+		return matcher;
+	}
+
+	if (LiteralMatcher::is_literal(pattern))
+		return new LiteralMatcher(pattern);
+
+	/*
+	 * NOTE: pattern2regexp() modifies pattern pointer and may throw
+	 */
+	re_pattern = pattern2regexp(pattern);
+	qreg_machine.reset();
+#ifdef DEBUG
+	g_printf("REGEXP: %s\n", re_pattern);
+#endif
+	if (!re_pattern)
+		return NULL;
+	re = regexp_cache.get(re_pattern);
+	g_free(re_pattern);
+
+	return re ? new RegexpMatcher(re) : NULL;
+}
+
+/**
+ * Check whether a backward search may start searching
+ * at a position within a range.
+ *
+ * Occurrences are counted from the beginning of the range
+ * and do not overlap, so searching from the middle of
+ * the range could find differently aligned occurrences
+ * (e.g. for self-overlapping patterns).
+ * This is impossible if no occurrence begins less than
+ * the maximum occurrence length before the position:
+ * Searching from the beginning of the range would then
+ * continue with the leftmost occurrence at or after it.
+ *
+ * This may be called from worker threads.
+ */
+static bool
+is_search_boundary(const SearchMatcher &matcher,
+                   const gchar *range, gint len, gint pos)
+{
+	gint max_len = matcher.get_max_len();
+	gint from, to;
+	gint count = 1, matched_from = -1, matched_to = -1;
+
+	if (!pos)
+		return true;
+	if (max_len < 0)
+		return false;
+
+	from = MAX(pos - max_len + 1, 0);
+	to = MIN(pos + max_len - 1, len);
+	if (from >= to)
+		return true;
+
+	matcher.search(range + from, to - from, count,
+	               matched_from, matched_to);
+	return count || from + matched_from >= pos;
+}
+
+/**
+ * Search a range of memory.
+ *
+ * Backward searches only look at windows ending at
+ * the end of the range, doubling them until the occurrence
+ * is found, instead of enumerating all occurrences in the range.
+ * Windows must begin at positions where searching finds
+ * the same occurrences as searching the entire range
+ * (see is_search_boundary()), so they are only used
+ * by matchers with a bounded occurrence length.
+ *
+ * This may be called from worker threads.
+ *
+ * @param matcher The matcher to search with.
+ * @param range The memory to search.
+ * @param len Length of the range in bytes.
+ * @param count The occurrence to search for
+ *              (see SearchMatcher::search()).
+ * @param matched_from Start of the occurrence found.
+ *                     Left unchanged if none is found.
+ * @param matched_to End of the occurrence found.
+ *                   Left unchanged if none is found.
+ */
+static void
+search_range(const SearchMatcher &matcher, const gchar *range, gint len,
+             gint &count, gint &matched_from, gint &matched_to)
+{
+	gsize window_len = SEARCH_WINDOW_MIN;
+
+	if (count >= 0 || matcher.get_max_len() < 0) {
+		matcher.search(range, len, count, matched_from, matched_to);
+		return;
+	}
+
+	for (;;) {
+		gint window_from, window_count = count;
+		gint window_matched_from = -1, window_matched_to = -1;
+
+		window_from = window_len >= (gsize)len
+				? 0 : len - (gint)window_len;
+		window_len *= 2;
+
+		if (!is_search_boundary(matcher, range, len, window_from))
+			continue;
+
+		matcher.search(range + window_from, len - window_from,
+		               window_count,
+		               window_matched_from, window_matched_to);
+
+		if (!window_from || !window_count) {
+			count = window_count;
+			if (!count) {
+				matched_from = window_from + window_matched_from;
+				matched_to = window_from + window_matched_to;
+			}
+			break;
+		}
+	}
+}
+
+void
+StateSearch::do_search(const SearchMatcher &matcher,
+                       gint from, gint to, gint &count)
+{
+	const gchar *range;
+
+	gint matched_from = -1, matched_to = -1;
+
+	/*
+	 * NOTE: SCI_GETCHARACTERPOINTER would move the gap to
+	 * the end of the document, i.e. cost O(n) after every
+	 * modification.
+	 * SCI_GETRANGEPOINTER moves the gap only if it lies
+	 * within the range - and only to the range's beginning.
+	 * In the common case of searching forwards or backwards
+	 * from the last modification (where the gap is),
+	 * nothing is moved at all.
+	 */
+	range = (const gchar *)interface.ssm(SCI_GETRANGEPOINTER,
+	                                     from, to - from);
+
+	search_range(matcher, range, to - from, count,
+	             matched_from, matched_to);
+
+	if (matched_from >= 0 && matched_to >= 0)
+		/* match success */
+		interface.ssm(SCI_SETSEL, from + matched_from, from + matched_to);
+}
+
+/**
+ * Search of the buffer ring by several threads.
+ *
+ * Every job is a buffer to search, in ring order.
+ * Worker threads take the next job that has not been
+ * taken yet, until reaching a buffer that contains
+ * enough occurrences.
+ * Since worker threads only read buffer memory,
+ * no buffer may be modified while searching.
+ */
+class RingSearch {
+public:
+	struct Job {
+		Buffer *buffer;
+		gint from, to;
+		const gchar *range;
+
+		/**
+		 * Occurrences still to be found after
+		 * searching the buffer
+		 */
+		gint count;
+	};
+
+	const SearchMatcher &matcher;
+	/** Occurrence to search for in every buffer */
+	gint count;
+
+	/** Array of Job */
+	GArray *jobs;
+
+	/** Next job to take (accessed atomically) */
+	gint next_job;
+	/**
+	 * First job whose buffer contains `count`
+	 * occurrences (accessed atomically).
+	 * Later jobs do not have to be searched.
+	 */
+	gint found_job;
+
+	RingSearch(const SearchMatcher &_matcher, gint _count)
+		  : matcher(_matcher), count(_count),
+		    next_job(0), found_job(G_MAXINT)
+	{
+		jobs = g_array_new(FALSE, FALSE, sizeof(Job));
+	}
+	~RingSearch()
+	{
+		g_array_free(jobs, TRUE);
+	}
+
+	void run(void);
+
+private:
+	void search(Job &job) const;
+#if GLIB_CHECK_VERSION(2,36,0)
+	static gpointer worker(gpointer data);
+#endif
+};
+
+void
+RingSearch::search(Job &job) const
+{
+	gint matched_from, matched_to;
+
+	job.count = count;
+	search_range(matcher, job.range, job.to - job.from,
+	             job.count, matched_from, matched_to);
+}
+
+#if GLIB_CHECK_VERSION(2,36,0)
+
+gpointer
+RingSearch::worker(gpointer data)
+{
+	RingSearch *ctx = (RingSearch *)data;
+	gint num_jobs = ctx->jobs->len;
+	gint i;
+
+	while ((i = g_atomic_int_add(&ctx->next_job, 1)) < num_jobs &&
+	       i < g_atomic_int_get(&ctx->found_job)) {
+		Job &job = g_array_index(ctx->jobs, Job, i);
+		gint found_job;
+
+		ctx->search(job);
+		if (job.count)
+			continue;
+
+		do
+			found_job = g_atomic_int_get(&ctx->found_job);
+		while (i < found_job &&
+		       !g_atomic_int_compare_and_exchange(&ctx->found_job,
+		                                          found_job, i));
+	}
+
+	return NULL;
+}
+
+void
+RingSearch::run(void)
+{
+	gsize total_len = 0;
+	guint num_workers = 1;
+
+	for (guint i = 0; i < jobs->len; i++) {
+		Job &job = g_array_index(jobs, Job, i);
+		total_len += job.to - job.from;
+	}
+	if (total_len >= SEARCH_PARALLEL_MIN)
+		num_workers = jobs->len;
+
+	workers.run(worker, this, num_workers);
+}
+
+#else /* !GLIB_CHECK_VERSION(2,36,0) */
+
+void
+RingSearch::run(void)
+{
+	for (guint i = 0; i < jobs->len; i++) {
+		Job &job = g_array_index(jobs, Job, i);
+
+		search(job);
+		if (!job.count)
+			break;
+	}
+}
+
+#endif
+
+/**
+ * Search the buffers following `buffer` in the ring,
+ * up to `parameters.to_buffer`.
+ *
+ * The buffers are not edited while searching, but their
+ * memory is searched directly, possibly by several threads.
+ * Only the buffer containing the occurrence (if any) is
+ * searched again by the caller.
+ *
+ * @param matcher The matcher to search with.
+ * @param buffer The buffer searched last.
+ *               Updated with the buffer containing the
+ *               occurrence or the last buffer searched.
+ * @param step Number of buffers walked.
+ *             Updated with the number of buffers walked
+ *             up to the returned buffer.
+ * @param count Occurrences still to be found.
+ *              Updated with the occurrence to search for
+ *              in the returned buffer or the number of
+ *              occurrences not found.
+ * @param from Updated with the beginning of the range to
+ *             search in the returned buffer.
+ * @param to Updated with the end of the range to search
+ *           in the returned buffer.
+ * @return Whether an occurrence has been found.
+ */
+bool
+StateSearch::search_ring(const SearchMatcher &matcher, Buffer *&buffer,
+                         gint &step, gint &count, gint &from, gint &to)
+{
+	RingSearch ring_search(matcher, count);
+	RingSearch::Job *job;
+	bool found = false;
+
+	do {
+		RingSearch::Job new_job;
+
+		if (count > 0)
+			buffer = buffer->next() ? : ring.first();
+		else
+			buffer = buffer->prev() ? : ring.last();
+
+		new_job.buffer = buffer;
+		new_job.from = 0;
+		new_job.to = buffer->ssm(SCI_GETLENGTH);
+		if (buffer == parameters.to_buffer) {
+			if (count > 0)
+				new_job.to = parameters.dot;
+			else
+				new_job.from = parameters.dot;
+		}
+		/* see do_search() */
+		new_job.range = (const gchar *)
+		                buffer->ssm(SCI_GETRANGEPOINTER, new_job.from,
+		                            new_job.to - new_job.from);
+
+		g_array_append_val(ring_search.jobs, new_job);
+	} while (buffer != parameters.to_buffer);
+
+	ring_search.run();
+
+	/*
+	 * Count the occurrences in ring order.
+	 * Buffers up to the first one containing `ring_search.count`
+	 * occurrences have all been searched.
+	 */
+	for (guint i = 0; i < ring_search.jobs->len; i++) {
+		gint occurrences;
+
+		job = &g_array_index(ring_search.jobs, RingSearch::Job, i);
+		/* all occurrences unless job->count == 0 */
+		occurrences = ring_search.count - job->count;
+
+		step++;
+		if (!job->count || ABS(occurrences) >= ABS(count)) {
+			found = true;
+			break;
+		}
+		count -= occurrences;
+	}
+
+	buffer = job->buffer;
+	from = job->from;
+	to = job->to;
+	return found;
+}
+
+void
+StateSearch::process(const gchar *str, gint new_chars)
+{
+	QRegister *search_reg = QRegisters::globals["_"];
+
+	SearchMatcher *matcher;
+
+	Buffer *buffer = parameters.from_buffer;
+	gint step = 0;
+	gint from = parameters.from, to;
+	bool edited = false;
+
+	gint count = parameters.count;
+
+	if (current_doc_must_undo())
+		interface.undo_ssm(SCI_SETSEL,
+		                   interface.ssm(SCI_GETANCHOR),
+		                   interface.ssm(SCI_GETCURRENTPOS));
+
+	search_reg->undo_set_integer();
+	search_reg->set_integer(FAILURE);
+
+	undo.push_var(resume);
+
+	if (!multi && LiteralMatcher::is_literal(str)) {
+		gint pattern_len = strlen(str);
+
+		/*
+		 * Every occurrence of an extended literal pattern is
+		 * also an occurrence of the old pattern, so when typing
+		 * the pattern, we can resume the search where the
+		 * old pattern has been found.
+		 */
+		if (count == 1 && new_chars > 0 &&
+		    resume.pattern_len == pattern_len - new_chars) {
+			resume.pattern_len = pattern_len;
+			if (resume.step < 0)
+				/* old pattern not found - nothing changes */
+				goto failure;
+
+			step = resume.step;
+			buffer = resume.buffer;
+			from = resume.pos;
+		} else {
+			resume.pattern_len = count == 1 ? pattern_len : -1;
+		}
+	} else {
+		resume.pattern_len = -1;
+	}
+
+	matcher = new_matcher(str);
+	if (!matcher)
+		goto failure;
+
+	if (!QRegisters::current && ring.current != buffer) {
+		ring.undo_edit();
+		edited = true;
+		ring.current = buffer;
+		buffer->edit();
+	}
+
+	/*
+	 * Search the range in the first buffer, then search
+	 * the following buffers in the ring (N and _ commands)
+	 * until reaching `to_buffer`.
+	 */
+	to = step ? interface.ssm(SCI_GETLENGTH) : parameters.to;
+	if (step && buffer == parameters.to_buffer) {
+		if (count > 0)
+			to = parameters.dot;
+		else
+			from = parameters.dot;
+	}
+
+	do_search(*matcher, from, to, count);
+
+	if (count && parameters.to_buffer &&
+	    !(step && buffer == parameters.to_buffer)) {
+		bool found = search_ring(*matcher, buffer, step,
+		                         count, from, to);
+
+		if (buffer != ring.current) {
+			if (!edited)
+				ring.undo_edit();
+			ring.current = buffer;
+			buffer->edit();
+		}
+
+		if (found)
+			/* select the occurrence */
+			do_search(*matcher, from, to, count);
+	}
+
+	if (!count) {
+		resume.step = step;
+		resume.buffer = buffer;
+		resume.pos = interface.ssm(SCI_GETANCHOR);
+	} else {
+		resume.step = -1;
+	}
+
+	if (multi && !count) {
+		/* the pattern found is reported as -1, -2, ... */
+		gint anchor = interface.ssm(SCI_GETANCHOR);
+		gint len = interface.ssm(SCI_GETCURRENTPOS) - anchor;
+		const gchar *occurrence;
+		gint pattern;
+
+		occurrence = (const gchar *)interface.ssm(SCI_GETRANGEPOINTER,
+		                                          anchor, len);
+		pattern = ((MultiMatcher *)matcher)->get_pattern(occurrence, len);
+		search_reg->set_integer(-1 - pattern);
+	} else {
+		search_reg->set_integer(TECO_BOOL(!count));
+	}
+
+	delete matcher;
+
+	if (!count)
+		return;
+
+failure:
+	interface.ssm(SCI_GOTOPOS, parameters.dot);
+}
+
+State *
+StateSearch::done(const gchar *str)
+{
+	BEGIN_EXEC(&States::start);
+
+	QRegister *search_reg = QRegisters::globals["_"];
+
+	if (*str) {
+		/* workaround: preserve selection (also on rubout) */
+		gint anchor = interface.ssm(SCI_GETANCHOR);
+		if (current_doc_must_undo())
+			interface.undo_ssm(SCI_SETANCHOR, anchor);
+
+		search_reg->undo_set_string();
+		search_reg->set_string(str);
+
+		interface.ssm(SCI_SETANCHOR, anchor);
+	} else {
+		gchar *search_str = search_reg->get_string();
+		process(search_str, 0 /* unused */);
+		g_free(search_str);
+	}
+
+	if (eval_colon())
+		expressions.push(search_reg->get_integer());
+	else if (IS_FAILURE(search_reg->get_integer()) &&
+	         !loop_stack.items() /* not in loop */)
+		interface.msg(InterfaceCurrent::MSG_ERROR, "Search string not found!");
+
+	return &States::start;
+}
+
+/*$ N
+ * [n]N[pattern]$ -- Search over buffer-boundaries
+ * -N[pattern]$
+ * from,toN[pattern]$
+ * [n]:N[pattern]$ -> Success|Failure
+ * -:N[pattern]$ -> Success|Failure
+ * from,to:N[pattern]$ -> Success|Failure
+ *
+ * Search for <pattern> over buffer boundaries.
+ * This command is similar to the regular search command
+ * (S) but will continue to search for occurrences of
+ * pattern when the end or beginning of the current buffer
+ * is reached.
+ * Occurrences of <pattern> spanning over buffer boundaries
+ * will not be found.
+ * When searching forward N will start in the current buffer
+ * at dot, continue with the next buffer in the ring searching
+ * the entire buffer until it reaches the end of the buffer
+ * ring, continue with the first buffer in the ring until
+ * reaching the current file again where it searched from the
+ * beginning of the buffer up to its current dot.
+ * Searching backwards does the reverse.
+ *
+ * N also differs from S in the interpretation of two arguments.
+ * Using two arguments the search will be bounded between the
+ * buffer with number <from>, up to the buffer with number
+ * <to>.
+ * When specifying buffer ranges, the entire buffers are searched
+ * from beginning to end.
+ * <from> may be greater than <to> in which case, searching starts
+ * at the end of buffer <from> and continues backwards until the
+ * beginning of buffer <to> has been reached.
+ * Furthermore as with all buffer numbers, the buffer ring
+ * is considered a circular structure and it is possible
+ * to search over buffer ring boundaries by specifying
+ * buffer numbers greater than the number of buffers in the
+ * ring.
+ */
+void
+StateSearchAll::initial(void)
+{
+	tecoInt v1, v2;
+
+	undo.push_var(parameters);
+
+	parameters.dot = interface.ssm(SCI_GETCURRENTPOS);
+
+	v2 = expressions.pop_num_calc();
+	if (expressions.args()) {
+		/* TODO: optional count argument? */
+		v1 = expressions.pop_num_calc();
+		if (v1 <= v2) {
+			parameters.count = 1;
+			parameters.from_buffer = ring.find(v1);
+			parameters.to_buffer = ring.find(v2);
+		} else {
+			parameters.count = -1;
 			parameters.from_buffer = ring.find(v2);
 			parameters.to_buffer = ring.find(v1);
 		}
@@ -727,6 +1971,9 @@ StateSearchAll::initial(void)
 		parameters.from = 0;
 		parameters.to = parameters.dot;
 	}
+
+	undo.push_var(resume);
+	resume.pattern_len = -1;
 }
 
 State *
@@ -740,6 +1987,49 @@ StateSearchAll::done(const gchar *str)
 	return &States::start;
 }
 
+/*$ FM FN
+ * FM[patterns]$ -- Search for any of several literal patterns
+ * [n]FM[patterns]$
+ * -FM[patterns]$
+ * from,toFM[patterns]$
+ * :FM[patterns]$ -> -index|Failure
+ * [n]:FM[patterns]$ -> -index|Failure
+ * -:FM[patterns]$ -> -index|Failure
+ * from,to:FM[patterns]$ -> -index|Failure
+ * [n]FN[patterns]$
+ * -FN[patterns]$
+ * from,toFN[patterns]$
+ * [n]:FN[patterns]$ -> -index|Failure
+ * -:FN[patterns]$ -> -index|Failure
+ * from,to:FN[patterns]$ -> -index|Failure
+ *
+ * Search for the leftmost occurrence of any of the
+ * newline-separated literal strings in <patterns>.
+ * FM takes the same arguments as the regular search
+ * command (S), while FN searches over buffer boundaries
+ * like N.
+ * The list of patterns is usually taken from a Q-Register
+ * using string building, e.g. \(lqFM^EQq$\(rq.
+ * Empty lines are ignored and the patterns do not support
+ * any match constructs.
+ * Like all searches, the patterns are matched case-insensitively.
+ * If several patterns begin at the same position, the longest
+ * one is found.
+ *
+ * This is considerably faster than searching for an
+ * alternative of many patterns (\(lq^E[...]\(rq),
+ * as all patterns are matched in a single pass over the
+ * buffer, independent of the number of patterns.
+ *
+ * The search register \(lq_\(rq is set as with S,
+ * but after a successful search its integer part identifies
+ * the pattern that has been found: -1 for the first pattern,
+ * -2 for the second one, etc.
+ * This is still a success boolean, so that the break-commands
+ * and conditionals work as with S.
+ * When colon-modified, the same value is returned.
+ */
+
 /*$ FK
  * FK[pattern]$ -- Delete up to occurrence of pattern
  * [n]FK[pattern]$
@@ -794,7 +2084,7 @@ StateSearchKill::done(const gchar *str)
 	ring.dirtify();
 
 	if (current_doc_must_undo())
-		interface.undo_ssm(SCI_UNDO);
+		interface.undo_modification();
 
 	return &States::start;
 }
@@ -828,7 +2118,7 @@ StateSearchDelete::done(const gchar *str)
 		ring.dirtify();
 
 		if (current_doc_must_undo())
-			interface.undo_ssm(SCI_UNDO);
+			interface.undo_modification();
 	}
 
 	return &States::start;
@@ -875,6 +2165,186 @@ StateReplace_ignore::done(const gchar *str)
 	return &States::start;
 }
 
+/*$ FA
+ * FA[pattern]$[string]$ -- Search and replace all occurrences
+ * [n]FA[pattern]$[string]$
+ * -FA[pattern]$[string]$
+ * from,toFA[pattern]$[string]$
+ * :FA[pattern]$[string]$ -> Success|Failure
+ * [n]:FA[pattern]$[string]$ -> Success|Failure
+ * -:FA[pattern]$[string]$ -> Success|Failure
+ * from,to:FA[pattern]$[string]$ -> Success|Failure
+ *
+ * Searches for <pattern> just like the FS command but
+ * replaces all occurrences with <string> at once.
+ * Without arguments, all occurrences from dot up to the
+ * end of the buffer are replaced.
+ * \(lq-FA\(rq replaces all occurrences before dot.
+ * With a single argument, at most the first <n> occurrences
+ * after dot are replaced, or the last <n> occurrences before
+ * dot if <n> is negative.
+ * <n> must not be 0.
+ * With two arguments, all occurrences in the character range
+ * <from> up to <to> are replaced.
+ *
+ * This is much faster than replacing occurrences in
+ * a loop (e.g. \(lq<FS[pattern]$[string]$;>\(rq) since the
+ * buffer is modified only once.
+ * It also results in a single undo action.
+ * Afterwards, dot is positioned after the last replacement
+ * in search direction.
+ *
+ * As with FS, the global replace register is not touched.
+ * In interactive mode, the first occurrence is highlighted
+ * as you type, but the replacement is only performed
+ * on command termination.
+ */
+void
+StateReplaceAll::initial(void)
+{
+	guint args = expressions.args();
+
+	StateSearch::initial();
+
+	undo.push_var(max_count);
+	if (args == 1) {
+		if (!parameters.count)
+			throw RangeError("FA");
+
+		/* search for the first/last occurrence only */
+		max_count = ABS(parameters.count);
+		parameters.count = parameters.count < 0 ? -1 : 1;
+	} else {
+		max_count = G_MAXINT;
+	}
+}
+
+State *
+StateReplaceAll::done(const gchar *str)
+{
+	BEGIN_EXEC(&States::replace_ignore);
+
+	QRegister *search_reg = QRegisters::globals["_"];
+
+	StateSearch::done(str);
+
+	return IS_SUCCESS(search_reg->get_integer())
+		? (State *)&States::replaceall_insert
+		: (State *)&States::replace_ignore;
+}
+
+/**
+ * Replace the occurrences of the last search pattern
+ * in the current document.
+ *
+ * All occurrences are found in a single pass and the
+ * affected part of the document is rebuilt in a single
+ * copy, so it is modified only once.
+ *
+ * @param replacement The string to replace the occurrences with.
+ */
+void
+StateReplaceAll::replace_all(const gchar *replacement)
+{
+	QRegister *search_reg = QRegisters::globals["_"];
+	SearchMatcher *matcher;
+	gchar *pattern;
+
+	gint from = parameters.from, to = parameters.to;
+	const gchar *range;
+	GArray *occurrences;
+
+	pattern = search_reg->get_string();
+	try {
+		matcher = new_matcher(pattern);
+	} catch (...) {
+		g_free(pattern);
+		throw;
+	}
+	g_free(pattern);
+	if (!matcher)
+		return;
+
+	if (parameters.count < 0 && max_count < G_MAXINT) {
+		/*
+		 * Find the first occurrence to replace.
+		 * If there are less than `max_count' occurrences,
+		 * all of them are replaced.
+		 */
+		gint count = -max_count;
+
+		do_search(*matcher, from, to, count);
+		if (!count)
+			from = interface.ssm(SCI_GETANCHOR);
+	}
+
+	occurrences = g_array_new(FALSE, FALSE,
+	                          sizeof(SearchMatcher::Occurrence));
+
+	range = (const gchar *)interface.ssm(SCI_GETRANGEPOINTER,
+	                                     from, to - from);
+	matcher->find_all(range, to - from, max_count, occurrences);
+	delete matcher;
+
+	if (occurrences->len > 0) {
+		SearchMatcher::Occurrence *occurrence =
+			(SearchMatcher::Occurrence *)occurrences->data;
+		gint first = occurrence[0].from;
+		gint last = occurrence[occurrences->len-1].to;
+		gsize replacement_len = strlen(replacement);
+
+		gsize text_len = last - first;
+		gchar *text, *p;
+		gint pos = first, dot;
+
+		for (guint i = 0; i < occurrences->len; i++)
+			text_len += replacement_len -
+			            (occurrence[i].to - occurrence[i].from);
+		p = text = (gchar *)g_malloc(text_len);
+
+		for (guint i = 0; i < occurrences->len; i++) {
+			memcpy(p, range + pos, occurrence[i].from - pos);
+			p += occurrence[i].from - pos;
+			memcpy(p, replacement, replacement_len);
+			p += replacement_len;
+			pos = occurrence[i].to;
+		}
+
+		dot = from + first +
+		      (parameters.count > 0 ? text_len : replacement_len);
+
+		if (current_doc_must_undo())
+			interface.undo_ssm(SCI_SETSEL,
+			                   interface.ssm(SCI_GETANCHOR),
+			                   interface.ssm(SCI_GETCURRENTPOS));
+
+		interface.ssm(SCI_BEGINUNDOACTION);
+		interface.ssm(SCI_SETTARGETSTART, from + first);
+		interface.ssm(SCI_SETTARGETEND, from + last);
+		interface.ssm(SCI_REPLACETARGET, text_len, (sptr_t)text);
+		interface.ssm(SCI_GOTOPOS, dot);
+		interface.ssm(SCI_ENDUNDOACTION);
+		ring.dirtify();
+
+		if (current_doc_must_undo())
+			interface.undo_modification();
+
+		g_free(text);
+	}
+
+	g_array_free(occurrences, TRUE);
+}
+
+State *
+StateReplaceAll_insert::done(const gchar *str)
+{
+	BEGIN_EXEC(&States::start);
+
+	States::replaceall.replace_all(str);
+
+	return &States::start;
+}
+
 /*$ FR
  * FR[pattern]$[string]$ -- Search and replace with default
  * [n]FR[pattern]$[string]$
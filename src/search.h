@@ -20,6 +20,11 @@
 
 #include <glib.h>
 
+#ifdef HAVE_PCRE2
+#define PCRE2_CODE_UNIT_WIDTH 8
+#include <pcre2.h>
+#endif
+
 #include "sciteco.h"
 #include "parser.h"
 #include "ring.h"
@@ -27,14 +32,222 @@
 
 namespace SciTECO {
 
+/**
+ * Strategy for finding occurrences of a search
+ * pattern in a buffer.
+ *
+ * Searching does not modify the matcher, so a single
+ * matcher may search several buffers in parallel.
+ */
+class SearchMatcher : public Object {
+public:
+	struct Occurrence {
+		gint from, to;
+	};
+
+	virtual ~SearchMatcher() {}
+
+	/**
+	 * Search for occurrences of the pattern.
+	 *
+	 * Occurrences do not overlap and are counted from
+	 * the beginning of the range.
+	 * All positions are relative to the range.
+	 *
+	 * @param range The memory to search.
+	 * @param len Length of the range in bytes.
+	 * @param count The occurrence to search for.
+	 *              Positive values count from the beginning
+	 *              of the range, negative ones from the end.
+	 *              Updated with the number of occurrences
+	 *              that are still to be found, so it is 0
+	 *              after a successful search.
+	 * @param matched_from Start of the occurrence found.
+	 * @param matched_to End of the occurrence found.
+	 */
+	virtual void search(const gchar *range, gint len, gint &count,
+	                    gint &matched_from, gint &matched_to) const = 0;
+
+	/**
+	 * Find all occurrences of the pattern.
+	 *
+	 * @param range The memory to search.
+	 * @param len Length of the range in bytes.
+	 * @param max_count Maximum number of occurrences to find.
+	 * @param occurrences Array of Occurrence to append
+	 *                    the occurrences to, in ascending order.
+	 *                    Positions are relative to the range.
+	 */
+	virtual void find_all(const gchar *range, gint len, gint max_count,
+	                      GArray *occurrences) const = 0;
+
+	/**
+	 * Get the maximum length of occurrences.
+	 *
+	 * Matchers with a bounded occurrence length must
+	 * always find the leftmost occurrence beginning at
+	 * or after the position searched from, independent
+	 * of the memory before it.
+	 * This allows backward searches to start searching
+	 * in the middle of a range (see search_range()).
+	 *
+	 * @return Length in bytes or -1 if occurrences can
+	 *         be arbitrarily long.
+	 */
+	virtual gint
+	get_max_len(void) const
+	{
+		return -1;
+	}
+};
+
+#ifdef HAVE_PCRE2
+/** Compiled regular expression (JIT-compiled if possible) */
+typedef pcre2_code Regexp;
+#else
+typedef GRegex Regexp;
+#endif
+
+class RegexpMatcher : public SearchMatcher {
+	/** Compiled expression, owned by the regexp cache */
+	Regexp *re;
+
+#ifdef HAVE_PCRE2
+	pcre2_match_context *context;
+
+	bool match(pcre2_match_data *match_data,
+	           const gchar *range, gint len,
+	           gint &pos, bool &after_empty,
+	           gint &matched_from, gint &matched_to) const;
+#else
+	bool match(const gchar *range, gint len,
+	           gint &pos, bool &after_empty,
+	           gint &matched_from, gint &matched_to) const;
+#endif
+
+public:
+#ifdef HAVE_PCRE2
+	RegexpMatcher(Regexp *_re);
+	~RegexpMatcher()
+	{
+		pcre2_match_context_free(context);
+	}
+#else
+	RegexpMatcher(Regexp *_re) : re(_re) {}
+#endif
+
+	void search(const gchar *range, gint len, gint &count,
+	            gint &matched_from, gint &matched_to) const;
+	void find_all(const gchar *range, gint len, gint max_count,
+	              GArray *occurrences) const;
+};
+
+/**
+ * Matcher for patterns without any match constructs,
+ * avoiding the regular expression engine.
+ */
+class LiteralMatcher : public SearchMatcher {
+	/** The pattern folded to lower case */
+	gchar *pattern;
+	gsize len;
+
+	/** Horspool skip table */
+	gsize skip[256];
+
+	const gchar *find_chr(const gchar *p, const gchar *end) const;
+
+public:
+	LiteralMatcher(const gchar *_pattern);
+	~LiteralMatcher()
+	{
+		g_free(pattern);
+	}
+
+	static bool is_literal(const gchar *pattern);
+
+	const gchar *find(const gchar *p, const gchar *end) const;
+
+	void search(const gchar *range, gint len, gint &count,
+	            gint &matched_from, gint &matched_to) const;
+	void find_all(const gchar *range, gint len, gint max_count,
+	              GArray *occurrences) const;
+
+	gint
+	get_max_len(void) const
+	{
+		return (gint)len;
+	}
+};
+
+/**
+ * Matcher for a newline-separated list of literal
+ * patterns, using an Aho-Corasick automaton.
+ *
+ * The automaton is a complete DFA over equivalence
+ * classes of bytes, so every byte costs a single
+ * table lookup.
+ */
+class MultiMatcher : public SearchMatcher {
+	/** Lengths of the patterns in bytes, by pattern index */
+	GArray *pattern_lens;
+	gint max_len;
+
+	/** Byte to equivalence class mapping */
+	guchar classes[256];
+	guint num_classes;
+
+	/**
+	 * State transitions, indexed by
+	 * state*num_classes + class.
+	 * State 0 is the root.
+	 */
+	gint *delta;
+	/**
+	 * Index of the longest pattern ending in a
+	 * state or -1.
+	 */
+	gint *output;
+	guint num_states;
+
+	const gchar *find(const gchar *p, const gchar *end,
+	                  gint &matched_len, gint &matched_pattern) const;
+
+public:
+	MultiMatcher(const gchar *patterns);
+	~MultiMatcher();
+
+	inline guint
+	size(void) const
+	{
+		return pattern_lens->len;
+	}
+
+	gint get_pattern(const gchar *occurrence, gint len) const;
+
+	void search(const gchar *range, gint len, gint &count,
+	            gint &matched_from, gint &matched_to) const;
+	void find_all(const gchar *range, gint len, gint max_count,
+	              GArray *occurrences) const;
+
+	gint
+	get_max_len(void) const
+	{
+		return max_len;
+	}
+};
+
 /*
  * "S" command state and base class for all other search/replace commands
  */
 class StateSearch : public StateExpectString {
 public:
-	StateSearch(bool last = true) : StateExpectString(true, last) {}
+	StateSearch(bool last = true, bool _multi = false)
+	           : StateExpectString(true, last), multi(_multi) {}
 
 protected:
+	/** Whether the pattern is a list of literal patterns */
+	bool multi;
+
 	struct Parameters {
 		gint dot;
 		gint from, to;
@@ -43,6 +256,23 @@ protected:
 		Buffer *from_buffer, *to_buffer;
 	} parameters;
 
+	/**
+	 * Where the last search of the current command
+	 * found its occurrence, so search-as-you-type can
+	 * resume searching when the pattern is extended.
+	 */
+	struct Resume {
+		/** Length of the literal pattern or -1 */
+		gint pattern_len;
+		/**
+		 * Number of buffers walked before finding
+		 * the occurrence or -1 if it was not found.
+		 */
+		gint step;
+		Buffer *buffer;
+		gint pos;
+	} resume;
+
 	QRegSpecMachine qreg_machine;
 
 	enum MatchState {
@@ -57,7 +287,11 @@ protected:
 	gchar *class2regexp(MatchState &state, const gchar *&pattern,
 			    bool escape_default = false);
 	gchar *pattern2regexp(const gchar *&pattern, bool single_expr = false);
-	void do_search(GRegex *re, gint from, gint to, gint &count);
+	SearchMatcher *new_matcher(const gchar *pattern);
+	void do_search(const SearchMatcher &matcher,
+	               gint from, gint to, gint &count);
+	bool search_ring(const SearchMatcher &matcher, Buffer *&buffer,
+	                 gint &step, gint &count, gint &from, gint &to);
 
 	virtual void initial(void);
 	virtual void process(const gchar *str, gint new_chars);
@@ -65,6 +299,9 @@ protected:
 };
 
 class StateSearchAll : public StateSearch {
+public:
+	StateSearchAll(bool multi = false) : StateSearch(true, multi) {}
+
 private:
 	void initial(void);
 	State *done(const gchar *str);
@@ -101,6 +338,25 @@ private:
 	State *done(const gchar *str);
 };
 
+class StateReplaceAll : public StateSearch {
+	/** Maximum number of occurrences to replace */
+	gint max_count;
+
+public:
+	StateReplaceAll() : StateSearch(false) {}
+
+	void replace_all(const gchar *replacement);
+
+private:
+	void initial(void);
+	State *done(const gchar *str);
+};
+
+class StateReplaceAll_insert : public StateExpectString {
+private:
+	State *done(const gchar *str);
+};
+
 class StateReplaceDefault : public StateSearchDelete {
 public:
 	StateReplaceDefault() : StateSearchDelete(false) {}
@@ -125,11 +381,16 @@ namespace States {
 	extern StateSearchAll			searchall;
 	extern StateSearchKill			searchkill;
 	extern StateSearchDelete		searchdelete;
+	extern StateSearch			searchmulti;
+	extern StateSearchAll			searchallmulti;
 
 	extern StateReplace			replace;
 	extern StateReplace_insert		replace_insert;
 	extern StateReplace_ignore		replace_ignore;
 
+	extern StateReplaceAll			replaceall;
+	extern StateReplaceAll_insert		replaceall_insert;
+
 	extern StateReplaceDefault		replacedefault;
 	extern StateReplaceDefault_insert	replacedefault_insert;
 	extern StateReplaceDefault_ignore	replacedefault_ignore;
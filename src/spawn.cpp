@@ -446,7 +446,7 @@ StateExecuteCommand::done(const gchar *str)
 	} else if (ctx.from != ctx.to || ctx.text_added) {
 		/* undo action is only effective if it changed anything */
 		if (current_doc_must_undo())
-			interface.undo_ssm(SCI_UNDO);
+			interface.undo_modification();
 		interface.ssm(SCI_SCROLLCARET);
 		ring.dirtify();
 	}
@@ -20,8 +20,18 @@
 #endif
 
 #include <stdio.h>
+#include <errno.h>
 #include <bsd/sys/queue.h>
 
+/* NOTE: UNDO_SPILL is only defined in undo.h */
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 #include <glib.h>
 #include <glib/gstdio.h>
 
@@ -37,6 +47,156 @@ namespace SciTECO {
 
 UndoStack undo;
 
+#if defined(UNDO_SPILL) && !defined(MAP_ANONYMOUS)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+UndoStack::~UndoStack()
+{
+	clear();
+	g_ptr_array_free(heads, TRUE);
+	free_chunk(spare);
+
+#ifdef UNDO_SPILL
+	if (spill_fd >= 0)
+		close(spill_fd);
+#endif
+}
+
+/**
+ * Allocate a new chunk for the undo token arena
+ * and make it the current chunk.
+ *
+ * @param size Minimum size of the chunk's data.
+ */
+void
+UndoStack::new_chunk(gsize size)
+{
+	Chunk *next;
+
+	if (spare && spare->end - spare->data() >= (gssize)size) {
+		next = spare;
+		spare = NULL;
+	} else {
+		gsize alloc_size = UNDO_ALIGN(sizeof(Chunk)) +
+		                   MAX(size, UNDO_CHUNK_SIZE);
+
+#ifdef UNDO_SPILL
+		/*
+		 * Chunks are mapped separately, so they can
+		 * later be replaced by a mapping of the spill file.
+		 */
+		gsize page_size = sysconf(_SC_PAGESIZE);
+
+		alloc_size = (alloc_size + page_size-1) & ~(page_size-1);
+		next = (Chunk *)mmap(NULL, alloc_size, PROT_READ | PROT_WRITE,
+		                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (G_UNLIKELY(next == MAP_FAILED))
+			g_error("Cannot map undo chunk: %s", g_strerror(errno));
+		MemoryLimit::account(alloc_size);
+#else
+		/*
+		 * NOTE: Allocating via Object ensures that chunks
+		 * are accounted for by the memory limiting.
+		 */
+		next = (Chunk *)Object::operator new(alloc_size);
+#endif
+		next->end = (gchar *)next + alloc_size;
+	}
+
+	next->top = next->data();
+	next->spilled = false;
+	next->prev = chunk;
+	chunk = next;
+}
+
+void
+UndoStack::free_chunk(Chunk *chunk)
+{
+	if (!chunk)
+		return;
+
+#ifdef UNDO_SPILL
+	gsize size = chunk->end - (gchar *)chunk;
+
+	/* spilled chunks have already been subtracted */
+	if (!chunk->spilled)
+		MemoryLimit::account(-(gssize)size);
+	munmap(chunk, size);
+#else
+	Object::operator delete(chunk, chunk->end - (gchar *)chunk);
+#endif
+}
+
+/**
+ * Release a chunk that is no longer used,
+ * possibly keeping it for reuse.
+ */
+void
+UndoStack::recycle_chunk(Chunk *chunk)
+{
+	if (chunk->spilled) {
+		/* would write through to the spill file */
+		free_chunk(chunk);
+	} else {
+		free_chunk(spare);
+		spare = chunk;
+	}
+}
+
+/**
+ * Destroy an undo token and free its memory.
+ *
+ * Since the arena is a stack, this must be the
+ * most recently allocated token.
+ */
+void
+UndoStack::release(UndoToken *token)
+{
+	token->~UndoToken();
+
+	g_assert((gchar *)token >= chunk->data() &&
+	         (gchar *)token < chunk->top);
+	chunk->top = (gchar *)token;
+
+	if (chunk->top == chunk->data()) {
+		/* chunk is empty */
+		Chunk *prev = chunk->prev;
+
+		recycle_chunk(chunk);
+		chunk = prev;
+	}
+}
+
+/**
+ * Check whether a variable has already been recorded
+ * at the current command line position and mark it
+ * as recorded.
+ *
+ * @param ptr Address of the variable.
+ * @param size Size of the variable in bytes.
+ * @returns true if the variable does not have to be
+ *          recorded again.
+ */
+bool
+UndoStack::coalesce_var(const void *ptr, gsize size)
+{
+	guintptr hash = (guintptr)ptr;
+	hash = (hash >> 3) ^ (hash >> 9) ^ size;
+
+	VarCacheEntry &entry = var_cache[hash & (UNDO_VAR_CACHE_SIZE-1)];
+
+	if (entry.ptr == ptr && entry.size == size &&
+	    entry.pc == cmdline.pc && entry.generation == generation)
+		return true;
+
+	entry.ptr = ptr;
+	entry.size = size;
+	entry.pc = cmdline.pc;
+	entry.generation = generation;
+	return false;
+}
+
 void
 UndoStack::push(UndoToken *token)
 {
@@ -67,6 +227,8 @@ UndoStack::push(UndoToken *token)
 void
 UndoStack::pop(gint pc)
 {
+	generation++;
+
 	while ((gint)heads->len > pc) {
 		UndoToken *top =
 			(UndoToken *)g_ptr_array_remove_index(heads, heads->len-1);
@@ -80,7 +242,7 @@ UndoStack::pop(gint pc)
 #endif
 			top->run();
 
-			delete top;
+			release(top);
 			top = next;
 		}
 	}
@@ -89,16 +251,141 @@ UndoStack::pop(gint pc)
 void
 UndoStack::clear(void)
 {
+	generation++;
+
 	while (heads->len) {
 		UndoToken *top =
 			(UndoToken *)g_ptr_array_remove_index(heads, heads->len-1);
 
 		while (top) {
 			UndoToken *next = SLIST_NEXT(top, tokens);
-			delete top;
+			top->~UndoToken();
 			top = next;
 		}
 	}
+
+	/*
+	 * Release all chunks at once, keeping only
+	 * the bottom-most one for reuse.
+	 */
+	while (chunk) {
+		Chunk *prev = chunk->prev;
+
+		recycle_chunk(chunk);
+		chunk = prev;
+	}
+
+#ifdef UNDO_SPILL
+	if (spill_size) {
+		/* all spilled chunks are gone */
+		if (ftruncate(spill_fd, 0))
+			g_warning("Cannot truncate undo spill file: %s",
+			          g_strerror(errno));
+		spill_size = 0;
+	}
+#endif
 }
 
+#ifdef UNDO_SPILL
+
+/**
+ * Open the anonymous temporary file, undo
+ * chunks are spilled to.
+ *
+ * @returns true if the file could be opened.
+ */
+bool
+UndoStack::open_spill_file(void)
+{
+	const gchar *tmp_dir = g_get_tmp_dir();
+
+#ifdef O_TMPFILE
+	/* the file will never be visible in the file system */
+	spill_fd = open(tmp_dir, O_TMPFILE | O_RDWR, S_IRUSR | S_IWUSR);
+#endif
+	if (spill_fd < 0) {
+		gchar *filename;
+
+		spill_fd = g_file_open_tmp("sciteco-undo-XXXXXX",
+		                           &filename, NULL);
+		if (spill_fd < 0)
+			return false;
+		g_unlink(filename);
+		g_free(filename);
+	}
+
+	return true;
+}
+
+/**
+ * Spill undo chunks to a temporary file, so they
+ * no longer take up memory.
+ *
+ * All chunks except the current one (containing the
+ * tokens of the most recent command line positions)
+ * are written to the spill file and then replaced
+ * by mappings of that file at the same addresses.
+ * The tokens can thus be used as before.
+ * Their pages are only read back when they are
+ * accessed again, i.e. when rubbing out into the
+ * spilled command line region or when the
+ * command line is terminated.
+ * Until then, the operating system can reclaim
+ * them without swapping.
+ *
+ * @returns The number of bytes no longer
+ *          taking up memory.
+ */
+gsize
+UndoStack::spill(void)
+{
+	gsize spilled_size = 0;
+
+	if (!chunk || (spill_fd < 0 && !open_spill_file()))
+		return 0;
+
+	for (Chunk *cur = chunk->prev; cur; cur = cur->prev) {
+		gsize size = cur->end - (gchar *)cur;
+		gsize written = 0;
+
+		if (cur->spilled)
+			continue;
+
+		/* must already be set in the spill file */
+		cur->spilled = true;
+
+		while (written < size) {
+			ssize_t rc = pwrite(spill_fd, (gchar *)cur + written,
+			                    size - written, spill_size + written);
+			if (rc < 0 && errno == EINTR)
+				continue;
+			if (rc <= 0)
+				break;
+			written += rc;
+		}
+		if (written < size) {
+			/* e.g. disk full - the chunk is still intact */
+			cur->spilled = false;
+			break;
+		}
+
+		/*
+		 * This atomically replaces the anonymous mapping,
+		 * so the chunk is never unmapped.
+		 */
+		if (mmap(cur, size, PROT_READ | PROT_WRITE,
+		         MAP_SHARED | MAP_FIXED, spill_fd, spill_size) == MAP_FAILED)
+			g_error("Cannot map undo spill file: %s",
+			        g_strerror(errno));
+
+		spill_size += size;
+		spilled_size += size;
+	}
+
+	MemoryLimit::account(-(gssize)spilled_size);
+	return spilled_size;
+}
+
+#endif /* UNDO_SPILL */
+
 } /* namespace SciTECO */
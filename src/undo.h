@@ -118,7 +118,94 @@ public:
 	}
 };
 
+/**
+ * Size of the chunks undo tokens are allocated from.
+ */
+#define UNDO_CHUNK_SIZE (64*1024)
+/**
+ * Round up size to the alignment of undo token allocations.
+ */
+#define UNDO_ALIGN(SIZE) \
+	(((SIZE) + G_MEM_ALIGN-1) & ~(gsize)(G_MEM_ALIGN-1))
+
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+/**
+ * Defined if undo chunks can be spilled to a temporary file.
+ */
+#define UNDO_SPILL
+#endif
+
+/**
+ * Number of entries in the cache of variables
+ * recorded per command line position.
+ * Must be a power of 2.
+ */
+#define UNDO_VAR_CACHE_SIZE 64
+
 extern class UndoStack : public Object {
+	/**
+	 * Chunk of the undo token arena.
+	 *
+	 * Undo tokens are always freed in the reverse order
+	 * of their allocation (they belong to increasing
+	 * command line positions), so they are allocated
+	 * from a stack of chunks by bumping a pointer.
+	 * Popping tokens just rewinds that pointer.
+	 */
+	struct Chunk {
+		Chunk *prev;
+		/** End of the chunk's data */
+		gchar *end;
+		/** First unused byte of the chunk's data */
+		gchar *top;
+		/** Whether the chunk is mapped from the spill file */
+		bool spilled;
+
+		inline gchar *
+		data(void)
+		{
+			return (gchar *)this + UNDO_ALIGN(sizeof(Chunk));
+		}
+	};
+
+	/** Current (top-most) chunk or NULL */
+	Chunk *chunk;
+	/**
+	 * Recently released chunk kept for reuse, so
+	 * pushing and popping at chunk boundaries does
+	 * not allocate repeatedly.
+	 */
+	Chunk *spare;
+
+	void new_chunk(gsize size);
+	static void free_chunk(Chunk *chunk);
+	void recycle_chunk(Chunk *chunk);
+
+#ifdef UNDO_SPILL
+	/** Temporary file for spilled chunks or -1 */
+	int spill_fd;
+	/** Size of the spill file in bytes */
+	goffset spill_size;
+
+	bool open_spill_file(void);
+#endif
+
+	inline void *
+	alloc(gsize size)
+	{
+		void *ptr;
+
+		size = UNDO_ALIGN(size);
+		if (G_UNLIKELY(!chunk || chunk->top + size > chunk->end))
+			new_chunk(size);
+
+		ptr = chunk->top;
+		chunk->top += size;
+		return ptr;
+	}
+
+	void release(UndoToken *token);
+
 	/**
 	 * Stack of UndoToken lists.
 	 *
@@ -134,18 +221,50 @@ extern class UndoStack : public Object {
 	 */
 	GPtrArray *heads;
 
+	/**
+	 * Cache of variables already recorded by an
+	 * UndoTokenVariable at the current command line
+	 * position.
+	 *
+	 * When a variable is written repeatedly while
+	 * executing one command line character (e.g. in loops),
+	 * only its oldest value has to be restored on rubout.
+	 * This is a direct-mapped cache, so collisions merely
+	 * result in redundant undo tokens.
+	 * Entries are keyed by address and size, since
+	 * e.g. a struct and its first member share the
+	 * same address.
+	 */
+	struct VarCacheEntry {
+		const void *ptr;
+		gsize size;
+		guint pc;
+		guint generation;
+	} var_cache[UNDO_VAR_CACHE_SIZE];
+	/**
+	 * Incremented whenever undo tokens are removed,
+	 * invalidating all var_cache entries.
+	 */
+	guint generation;
+
+	bool coalesce_var(const void *ptr, gsize size);
+
 	void push(UndoToken *token);
 
 public:
 	bool enabled;
 
 	UndoStack(bool _enabled = false)
-	         : heads(g_ptr_array_new()), enabled(_enabled) {}
-	~UndoStack()
+	         : chunk(NULL), spare(NULL),
+#ifdef UNDO_SPILL
+	           spill_fd(-1), spill_size(0),
+#endif
+	           heads(g_ptr_array_new()), generation(1),
+	           enabled(_enabled)
 	{
-		clear();
-		g_ptr_array_free(heads, TRUE);
+		memset(var_cache, 0, sizeof(var_cache));
 	}
+	~UndoStack();
 
 
 	/**
@@ -160,7 +279,7 @@ public:
 	push(Params && ... params)
 	{
 		if (enabled)
-			push(new TokenType(params...));
+			push(new (alloc(sizeof(TokenType))) TokenType(params...));
 	}
 
 	/**
@@ -180,7 +299,7 @@ public:
 	push_own(Params && ... params)
 	{
 		if (enabled) {
-			push(new TokenType(params...));
+			push(new (alloc(sizeof(TokenType))) TokenType(params...));
 		} else {
 			/* ensures that all memory is reclaimed */
 			TokenType dummy(params...);
@@ -191,7 +310,8 @@ public:
 	inline Type &
 	push_var(Type &variable, Type value)
 	{
-		push<UndoTokenVariable<Type>>(variable, value);
+		if (enabled && !coalesce_var(&variable, sizeof(Type)))
+			push<UndoTokenVariable<Type>>(variable, value);
 		return variable;
 	}
 
@@ -233,6 +353,16 @@ public:
 	void pop(gint pc);
 
 	void clear(void);
+
+#ifdef UNDO_SPILL
+	gsize spill(void);
+#else
+	inline gsize
+	spill(void)
+	{
+		return 0;
+	}
+#endif
 } undo;
 
 } /* namespace SciTECO */
@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2012-2017 Robin Haberkorn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <glib.h>
+
+#include "sciteco.h"
+#include "workers.h"
+
+namespace SciTECO {
+
+#if GLIB_CHECK_VERSION(2,36,0)
+
+WorkerPool workers;
+
+/**
+ * Invocations of a worker function belonging
+ * to a single WorkerPool::run().
+ */
+struct WorkerPool::Batch {
+	GThreadFunc func;
+	gpointer data;
+
+	/** Invocations still to return (protected by mutex) */
+	guint pending;
+
+	GMutex mutex;
+	GCond cond;
+};
+
+void
+WorkerPool::execute(gpointer data, gpointer user_data)
+{
+	Batch *batch = (Batch *)data;
+
+	batch->func(batch->data);
+
+	g_mutex_lock(&batch->mutex);
+	if (!--batch->pending)
+		g_cond_signal(&batch->cond);
+	g_mutex_unlock(&batch->mutex);
+}
+
+/**
+ * Run a worker function in several threads at once.
+ *
+ * The calling thread is a worker as well and this
+ * returns only after all invocations have returned.
+ * The worker function must therefore distribute the
+ * work itself (e.g. by taking jobs atomically) and
+ * return when there is nothing left to do.
+ *
+ * @param func The worker function.
+ * @param data Data to pass to every invocation of func.
+ * @param max_workers Maximum number of invocations,
+ *                    including the calling thread.
+ */
+void
+WorkerPool::run(GThreadFunc func, gpointer data, guint max_workers)
+{
+	Batch batch;
+	guint num_tasks;
+
+	if (G_UNLIKELY(!initialized)) {
+		/* the calling thread is a worker as well */
+		guint max_threads = g_get_num_processors() - 1;
+
+		/*
+		 * Exclusive pools create all threads at once,
+		 * so pushing tasks cannot fail later on.
+		 * If the threads cannot be created,
+		 * we simply work in the calling thread.
+		 */
+		if (max_threads > 0)
+			pool = g_thread_pool_new(execute, NULL, max_threads,
+			                         TRUE, NULL);
+		num_threads = pool ? max_threads : 0;
+		initialized = true;
+	}
+
+	batch.func = func;
+	batch.data = data;
+	num_tasks = max_workers > 1 ? MIN(max_workers-1, num_threads) : 0;
+	batch.pending = num_tasks;
+	g_mutex_init(&batch.mutex);
+	g_cond_init(&batch.cond);
+
+	for (guint i = 0; i < num_tasks; i++)
+		g_thread_pool_push(pool, &batch, NULL);
+
+	func(data);
+
+	g_mutex_lock(&batch.mutex);
+	while (batch.pending > 0)
+		g_cond_wait(&batch.cond, &batch.mutex);
+	g_mutex_unlock(&batch.mutex);
+
+	g_cond_clear(&batch.cond);
+	g_mutex_clear(&batch.mutex);
+}
+
+#endif
+
+} /* namespace SciTECO */
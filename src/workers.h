@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2012-2017 Robin Haberkorn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __WORKERS_H
+#define __WORKERS_H
+
+#include <glib.h>
+
+#include "sciteco.h"
+#include "memory.h"
+
+namespace SciTECO {
+
+#if GLIB_CHECK_VERSION(2,36,0)
+
+/**
+ * Pool of worker threads shared by all commands
+ * that distribute work among several threads.
+ *
+ * The threads are created on first use and are kept
+ * until the program terminates, so per-thread state
+ * (e.g. PCRE2 JIT stacks) can be reused by later commands.
+ * Worker functions must not allocate memory via
+ * C++ operators, since memory usage is not counted
+ * atomically.
+ */
+extern class WorkerPool : public Object {
+	struct Batch;
+
+	GThreadPool *pool;
+	/** Number of threads in the pool */
+	guint num_threads;
+	bool initialized;
+
+	static void execute(gpointer data, gpointer user_data);
+
+public:
+	WorkerPool() : pool(NULL), num_threads(0), initialized(false) {}
+
+	void run(GThreadFunc func, gpointer data, guint max_workers);
+} workers;
+
+#endif
+
+} /* namespace SciTECO */
+
+#endif